@@ -12,14 +12,42 @@
 #include <windows.h>
 #include <winerror.h>
 #include <detours.h>
+#include <tlhelp32.h>
+#include <psapi.h>
+#include <wbemidl.h>
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include <intrin.h>
+
+#include "FrameDetector.h"
+#include "WorkStealing.h"
+#include "TickController.h"
+#include "StatsSection.h"
+#include "WineSysfs.h"
 
 //! This is the number of CPUs that we'll tell the current process that we have.
 #define NUM_CPUS 16u
 
+//! REPORT_MULTIPLIER > 1 makes the limiter report more CPUs than it allows: every CPU in the limited set shows up as
+//! REPORT_MULTIPLIER virtual CPUs (at most 64 in total) through all of the hooked APIs, while threads still only run on
+//! the real set. Virtual CPU v is real CPU v % NUM_CPUS. This is meant for I/O-bound pools that size themselves by core
+//! count and would otherwise not keep enough requests in flight.
+#if !defined REPORT_MULTIPLIER
+#    define REPORT_MULTIPLIER 1
+#endif
+#define REPORTED_CPUS ((NUM_CPUS * REPORT_MULTIPLIER) < 64 ? (NUM_CPUS * REPORT_MULTIPLIER) : 64)
+
+//! When ENFORCE_AFFINITY is 1, every thread is restricted to the limited CPUs as it attaches (and threads that existed
+//! before we were loaded are restricted at DLL_PROCESS_ATTACH). Set to 0 to only lie about the topology.
+#if !defined ENFORCE_AFFINITY
+#    define ENFORCE_AFFINITY 1
+#endif
+
 //! Logging to OutputDebugString (i.e. readable with SysInternals DebugView) is enabled by setting LOGGING 1
 #if !defined LOGGING
 #    ifdef NDEBUG
@@ -31,6 +59,197 @@
 
 #define PROCINFO_LOGGING (LOGGING && 0)
 
+//! When NUMA_LOCAL_MEMORY is 1, GlobalMemoryStatusEx and GetPhysicallyInstalledSystemMemory report only the memory of
+//! the NUMA nodes that back the limited CPUs, so that games size their caches to fit local memory.
+#if !defined NUMA_LOCAL_MEMORY
+#    define NUMA_LOCAL_MEMORY 0
+#endif
+
+//! If non-zero, the physical memory reported by GlobalMemoryStatusEx and GetPhysicallyInstalledSystemMemory is capped
+//! to this many megabytes (applied after NUMA_LOCAL_MEMORY).
+#if !defined MEMORY_CAP_MB
+#    define MEMORY_CAP_MB 0
+#endif
+
+#define LIMIT_MEMORY (NUMA_LOCAL_MEMORY || MEMORY_CAP_MB)
+
+//! When FRAME_DETECTION is 1, Sleep and the WaitFor* functions are hooked to find frame boundaries from each thread's
+//! blocking pattern (see FrameDetector.h). This costs two QueryPerformanceCounter calls per blocking wait.
+#if !defined FRAME_DETECTION
+#    define FRAME_DETECTION 1
+#endif
+
+//! When TICK_TARGET_MS is non-zero, the enforced CPU set is grown and shrunk (between TICK_MIN_CPUS and NUM_CPUS) to
+//! keep the 99th percentile frame/tick time of the process's main loop, as found by FRAME_DETECTION, under the target
+//! while using as few CPUs as possible (see TickController.h). Meant for dedicated servers with a fixed tick rate.
+#if !defined TICK_TARGET_MS
+#    define TICK_TARGET_MS 0
+#endif
+#if !defined TICK_MIN_CPUS
+#    define TICK_MIN_CPUS 1
+#endif
+
+//! When JOBSERVER is 1, the CPU budget is shared with the whole process tree through a GNU make compatible jobserver
+//! (a named semaphore advertised with --jobserver-auth in MAKEFLAGS). If no jobserver is advertised, this process
+//! becomes the root and creates one holding NUM_CPUS - 1 tokens. Otherwise, it reports one CPU (the implicit token that
+//! every job has) plus however many tokens it has managed to take from the pool. Tokens are taken when the process asks
+//! for its processor count or keeps all of its CPUs busy, and handed back once a second as its CPU use drops.
+#if !defined JOBSERVER
+#    define JOBSERVER 0
+#endif
+
+//! When TUNE_SPIN_COUNTS is 1, spin counts passed to InitializeCriticalSectionAndSpinCount/InitializeCriticalSectionEx
+//! are scaled to the limited topology: no spinning with a single CPU, and less spinning where SMT siblings share
+//! a core. The topology is fetched on a thread pool thread after the DLL loads; critical sections set up before that
+//! keep the spin count they asked for.
+#if !defined TUNE_SPIN_COUNTS
+#    define TUNE_SPIN_COUNTS 1
+#endif
+
+//! When WORK_STEALING_POOL is 1, QueueUserWorkItem callbacks run on a built-in pool instead of the OS thread pool: one
+//! worker pinned to each allowed CPU, a work-stealing deque per worker, and steal order that prefers workers sharing
+//! an L3 cache (see WorkStealing.h). The wait hooks tell it when every worker is blocked inside a callback; queued and
+//! new work then goes to the OS pool, so callbacks that wait on each other can't deadlock it.
+#if !defined WORK_STEALING_POOL
+#    define WORK_STEALING_POOL 0
+#endif
+
+//! When WHOLE_CORES is 1 and NUM_CPUS would end partway through a core (say 5 CPUs with two logical processors per
+//! core), the limit is rounded down to whole cores when the DLL loads. Our threads then never run beside a sibling that
+//! the limit leaves to everything else. The rounded limit is used everywhere: placement, the reported counts and
+//! masks, and the topology. Windows has no counterpart to Linux core scheduling (prctl(PR_SCHED_CORE)), so the
+//! scheduler can still put other processes' threads on our cores; this only keeps the limit itself from splitting one.
+#if !defined WHOLE_CORES
+#    define WHOLE_CORES 0
+#endif
+
+//! When OVERHEAD_BUDGET_PERMILLE is non-zero, the limiter accounts for its own CPU time per feature, and when that goes
+//! over this share (in tenths of a percent) of the process's CPU time it degrades the most expensive feature a step
+//! at a time: thread rules are re-checked less often, the throttle cycle runs at a coarser resolution, and frame
+//! detection (and with it the tick controller and deadline reporting) is turned off. Once the overhead has stayed under
+//! half the budget for a while the last step is undone; a feature that goes over again waits twice as long next time.
+//! Every step goes to OutputDebugString, even without LOGGING, and to the metrics and stats section. The governor runs
+//! on the service thread but doesn't start it, and the wait hooks only time one wait in OVERHEAD_SAMPLE_WAITS.
+#if !defined OVERHEAD_BUDGET_PERMILLE
+#    define OVERHEAD_BUDGET_PERMILLE 5
+#endif
+#define OVERHEAD_SAMPLE_WAITS 16
+
+//! When METRICS_DIR is defined (a wide string, e.g. L"C:\\ProgramData\\node_exporter\\textfile"), the service
+//! thread writes the limiter's counters to cpulimiter_<pid>.prom in that directory about once a second, in Prometheus
+//! text format for a textfile collector to scrape. The file is replaced atomically, so a scrape never sees half of it.
+#if defined METRICS_DIR
+#    define METRICS 1
+#else
+#    define METRICS 0
+#endif
+
+//! When STATS_SECTION is 1, the service thread publishes placement and per-thread state in a named shared-memory
+//! section (see StatsSection.h) that tools/CpuLimiterTop.c displays, every STATS_INTERVAL_MS. Each update queries the
+//! CPU time and ideal processor of every thread, so it is off unless a monitor is wanted.
+#if !defined STATS_SECTION
+#    define STATS_SECTION 0
+#endif
+#if !defined STATS_INTERVAL_MS
+#    define STATS_INTERVAL_MS 100
+#endif
+
+//! When MIGRATION_DAMPING is 1, the wait hooks note which processor each thread wakes up on. A thread that moves
+//! between processors more than MIGRATION_RATE_LIMIT times a second is pinned to the processor it used most, and after
+//! MIGRATION_HOLD_SECONDS it is returned to where it was and watched again.
+#if !defined MIGRATION_DAMPING
+#    define MIGRATION_DAMPING 0
+#endif
+#if !defined MIGRATION_RATE_LIMIT
+#    define MIGRATION_RATE_LIMIT 200
+#endif
+#if !defined MIGRATION_HOLD_SECONDS
+#    define MIGRATION_HOLD_SECONDS 10
+#endif
+
+//! When WINE_TOPOLOGY is 1 and the DLL finds itself running under Wine (e.g. Proton), the processor topology is read
+//! from the Linux host's /sys/devices/system through Wine's Z: drive mapping of the host root instead of from Wine's
+//! GetLogicalProcessorInformation(Ex), which can leave out caches, NUMA nodes and efficiency classes.
+#if !defined WINE_TOPOLOGY
+#    define WINE_TOPOLOGY 1
+#endif
+
+//! When POOL_EFFICIENCY is 1, threads are grouped into pools (by the rule they match, otherwise by their start address)
+//! and each pool's CPU time and time blocked in the hooked waits are measured. Its effective parallelism (the average
+//! number of its threads running) and parallel efficiency are logged, and published in the metrics and stats section.
+//! A pool whose peak parallelism stays well under the enforced CPU count gains nothing from more cores. It is on by
+//! default only when something reports the figures, since measuring them keeps the service thread running.
+#if !defined POOL_EFFICIENCY
+#    define POOL_EFFICIENCY (FRAME_DETECTION && (LOGGING || METRICS || STATS_SECTION))
+#endif
+
+#if POOL_EFFICIENCY && !FRAME_DETECTION
+#    error POOL_EFFICIENCY requires FRAME_DETECTION
+#endif
+
+#if MIGRATION_DAMPING && !FRAME_DETECTION
+#    error MIGRATION_DAMPING requires FRAME_DETECTION
+#endif
+
+#if WORK_STEALING_POOL && !FRAME_DETECTION
+#    error WORK_STEALING_POOL requires FRAME_DETECTION
+#endif
+
+#if TICK_TARGET_MS && !(FRAME_DETECTION && ENFORCE_AFFINITY)
+#    error TICK_TARGET_MS requires FRAME_DETECTION and ENFORCE_AFFINITY
+#endif
+
+//! Thread rules single out threads by name (SetThreadDescription) and/or the module their start address is in, and
+//! give them special treatment. Patterns are case-insensitive and support * and ?; a NULL pattern matches anything.
+//! The first matching rule wins. Define THREAD_RULES as a list of ThreadRule initializers, for example:
+//!     #define THREAD_RULES { L"*Telemetry*", NULL, RuleThrottle, 10 }, { NULL, L"tamper*.dll", RuleThrottle, 25 },
+//! RuleRealtime raises a thread to time-critical priority and (with FRAME_DETECTION) counts ticks that overrun their
+//! deadline, which is the tick period stretched by DEADLINE_SLACK. RuleEfficiency and RulePerformance set the thread's
+//! power throttling (quality of service) level, which steers clock speed and P-core/E-core placement. RulePartition
+//! gives a class of threads its own slice of the enforced CPUs, e.g. render threads on 0-3 and workers on 4-15.
+#if !defined THREAD_RULES
+#    define THREAD_RULES
+#endif
+
+//! Throttled threads are suspended and resumed on a cycle of this length
+#if !defined THROTTLE_PERIOD_MS
+#    define THROTTLE_PERIOD_MS 50
+#endif
+
+#define DEADLINE_SLACK 1.25
+
+//! How often the service thread re-examines threads (rules, stats)
+#define SERVICE_INTERVAL_MS 1000
+
+typedef enum RuleAction
+{
+    RuleNone,
+    RuleThrottle,    // param: percentage of one CPU the thread may use
+    RuleRealtime,    // param: tick rate in Hz, or 0 to use the detected frame rate
+    RuleEfficiency,  // EcoQoS: prefer efficient cores and low clocks. param unused
+    RulePerformance, // High QoS: opt out of power throttling. param unused
+    RulePartition,   // param: affinity mask, intersected with the enforced set
+} RuleAction;
+
+typedef struct ThreadRule
+{
+    const WCHAR* name;
+    const WCHAR* module;
+    RuleAction action;
+    unsigned long long param;
+} ThreadRule;
+
+static const ThreadRule kThreadRules[] = { THREAD_RULES{ NULL, NULL, RuleNone, 0 } };
+
+// Features whose cost the overhead governor tracks
+typedef enum Feature
+{
+    FeatureFrames,       // Frame detection in the wait hooks
+    FeatureHousekeeping, // Service thread: rules, deadlines, tick controller
+    FeatureThrottle,     // Service thread: the throttle cycle
+    FeatureCount
+} Feature;
+
 // Typedefs for functions that we'll be hooking
 typedef void(WINAPI* GetSystemInfo_t)(LPSYSTEM_INFO);
 typedef void(WINAPI* GetNativeSystemInfo_t)(LPSYSTEM_INFO);
@@ -50,14 +269,56 @@ typedef BOOL(WINAPI* GetLogicalProcessorInformation_t)(PSYSTEM_LOGICAL_PROCESSOR
 typedef BOOL(WINAPI* GetLogicalProcessorInformationEx_t)(LOGICAL_PROCESSOR_RELATIONSHIP,
                                                          PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX,
                                                          PDWORD);
+typedef DWORD(WINAPI* GetActiveProcessorCount_t)(WORD);
+typedef DWORD(WINAPI* GetMaximumProcessorCount_t)(WORD);
+typedef WORD(WINAPI* GetActiveProcessorGroupCount_t)(void);
+typedef WORD(WINAPI* GetMaximumProcessorGroupCount_t)(void);
+typedef BOOL(WINAPI* GetNumaHighestNodeNumber_t)(PULONG);
+typedef BOOL(WINAPI* GetNumaNodeProcessorMask_t)(UCHAR, PULONGLONG);
+typedef BOOL(WINAPI* GetNumaNodeProcessorMaskEx_t)(USHORT, PGROUP_AFFINITY);
+typedef HANDLE(WINAPI* CreateIoCompletionPort_t)(HANDLE, HANDLE, ULONG_PTR, DWORD);
+typedef BOOL(WINAPI* InitializeCriticalSectionAndSpinCount_t)(LPCRITICAL_SECTION, DWORD);
+typedef BOOL(WINAPI* InitializeCriticalSectionEx_t)(LPCRITICAL_SECTION, DWORD, DWORD);
+typedef BOOL(WINAPI* QueueUserWorkItem_t)(LPTHREAD_START_ROUTINE, PVOID, ULONG);
+typedef BOOL(WINAPI* GlobalMemoryStatusEx_t)(LPMEMORYSTATUSEX);
+typedef BOOL(WINAPI* GetPhysicallyInstalledSystemMemory_t)(PULONGLONG);
+typedef void(WINAPI* Sleep_t)(DWORD);
+typedef DWORD(WINAPI* SleepEx_t)(DWORD, BOOL);
+typedef DWORD(WINAPI* WaitForSingleObject_t)(HANDLE, DWORD);
+typedef DWORD(WINAPI* WaitForSingleObjectEx_t)(HANDLE, DWORD, BOOL);
+typedef DWORD(WINAPI* WaitForMultipleObjects_t)(DWORD, const HANDLE*, BOOL, DWORD);
+typedef DWORD(WINAPI* WaitForMultipleObjectsEx_t)(DWORD, const HANDLE*, BOOL, DWORD, BOOL);
+typedef HRESULT(WINAPI* GetThreadDescription_t)(HANDLE, PWSTR*);
+typedef BOOL(WINAPI* SetThreadInformation_t)(HANDLE, THREAD_INFORMATION_CLASS, LPVOID, DWORD);
+typedef LONG(NTAPI* NtQueryInformationThread_t)(HANDLE, ULONG, PVOID, ULONG, PULONG);
+typedef HRESULT(WINAPI* CoCreateInstance_t)(REFCLSID, LPUNKNOWN, DWORD, REFIID, LPVOID*);
+typedef HMODULE(WINAPI* LoadLibraryExW_t)(LPCWSTR, HANDLE, DWORD);
 
 // TODO: CPU Set support?
 // TODO: Hybrid CPU detection? Offloading efficiency cores?
 
 static bool installed;
 
+#if WHOLE_CORES
+// Rounded down by RoundToWholeCores() before the hooks are installed, and constant after that
+static unsigned kNumCpus = NUM_CPUS;
+static unsigned long long kCpuMask = (1ull << NUM_CPUS) - 1;
+static unsigned kReportedCpus = REPORTED_CPUS;
+static unsigned long long kReportedMask = REPORTED_CPUS >= 64 ? ~0ull : (1ull << REPORTED_CPUS) - 1;
+#else
 const unsigned kNumCpus = NUM_CPUS;
 const unsigned long long kCpuMask = (1ull << NUM_CPUS) - 1;
+const unsigned kReportedCpus = REPORTED_CPUS;
+const unsigned long long kReportedMask = REPORTED_CPUS >= 64 ? ~0ull : (1ull << REPORTED_CPUS) - 1;
+#endif
+
+// Affinity mask that threads are placed on: the process affinity limited to kCpuMask. Computed in InstallDetours().
+static DWORD_PTR EnforcedMask;
+
+// How far the overhead governor has degraded each feature; 0 is full service. Only written by the service thread.
+static unsigned FeatureLevel[FeatureCount];
+static volatile LONG FeaturesDisabled; // Bit per Feature
+#define IsFeatureDisabled(f) (FeaturesDisabled & (1 << (f)))
 
 static GetSystemInfo_t OrigGetSystemInfo;
 static GetSystemInfo_t OrigGetNativeSystemInfo;
@@ -71,6 +332,27 @@ static SetThreadIdealProcessor_t OrigSetThreadIdealProcessor;
 static SetThreadIdealProcessorEx_t OrigSetThreadIdealProcessorEx;
 static GetLogicalProcessorInformation_t OrigGetLogicalProcessorInformation;
 static GetLogicalProcessorInformationEx_t OrigGetLogicalProcessorInformationEx;
+static GetActiveProcessorCount_t OrigGetActiveProcessorCount;
+static GetMaximumProcessorCount_t OrigGetMaximumProcessorCount;
+static GetActiveProcessorGroupCount_t OrigGetActiveProcessorGroupCount;
+static GetMaximumProcessorGroupCount_t OrigGetMaximumProcessorGroupCount;
+static GetNumaHighestNodeNumber_t OrigGetNumaHighestNodeNumber;
+static GetNumaNodeProcessorMask_t OrigGetNumaNodeProcessorMask;
+static GetNumaNodeProcessorMaskEx_t OrigGetNumaNodeProcessorMaskEx;
+static CreateIoCompletionPort_t OrigCreateIoCompletionPort;
+static InitializeCriticalSectionAndSpinCount_t OrigInitializeCriticalSectionAndSpinCount;
+static InitializeCriticalSectionEx_t OrigInitializeCriticalSectionEx;
+static QueueUserWorkItem_t OrigQueueUserWorkItem;
+static GlobalMemoryStatusEx_t OrigGlobalMemoryStatusEx;
+static GetPhysicallyInstalledSystemMemory_t OrigGetPhysicallyInstalledSystemMemory;
+static Sleep_t OrigSleep;
+static SleepEx_t OrigSleepEx;
+static WaitForSingleObject_t OrigWaitForSingleObject;
+static WaitForSingleObjectEx_t OrigWaitForSingleObjectEx;
+static WaitForMultipleObjects_t OrigWaitForMultipleObjects;
+static WaitForMultipleObjectsEx_t OrigWaitForMultipleObjectsEx;
+static CoCreateInstance_t OrigCoCreateInstance;
+static LoadLibraryExW_t OrigLoadLibraryExW;
 
 #define boolstr(s) (s ? "true" : "false")
 
@@ -113,36 +395,286 @@ static void Log_(const char* str, ...)
 #    define Log(...) ((void)0)
 #endif
 
+#if METRICS
+// Per-hook call counters. Each thread counts its own calls in its ThreadState (the wait hooks are far too hot for a
+// shared counter); WriteMetrics sums them.
+#    define COUNTED_HOOKS(X)                                                                                           \
+        X(GetSystemInfo) X(GetNativeSystemInfo) X(GetProcessAffinityMask) X(SetProcessAffinityMask)                    \
+        X(SetThreadAffinityMask) X(GetProcessGroupAffinity) X(GetThreadGroupAffinity) X(SetThreadGroupAffinity)        \
+        X(SetThreadIdealProcessor) X(SetThreadIdealProcessorEx) X(GetLogicalProcessorInformation)                      \
+        X(GetLogicalProcessorInformationEx) X(GetActiveProcessorCount) X(GetMaximumProcessorCount)                     \
+        X(GetActiveProcessorGroupCount) X(GetMaximumProcessorGroupCount) X(GetNumaHighestNodeNumber)                   \
+        X(GetNumaNodeProcessorMask) X(GetNumaNodeProcessorMaskEx) X(CreateIoCompletionPort) X(GlobalMemoryStatusEx)    \
+        X(GetPhysicallyInstalledSystemMemory) X(InitializeCriticalSectionAndSpinCount) X(InitializeCriticalSectionEx)  \
+        X(QueueUserWorkItem) X(Sleep) X(SleepEx) X(WaitForSingleObject) X(WaitForSingleObjectEx)                       \
+        X(WaitForMultipleObjects) X(WaitForMultipleObjectsEx) X(CoCreateInstance)
+#    define COUNTER_ENUM(fn) Calls_##fn,
+#    define COUNTER_NAME(fn) #fn,
+
+enum
+{
+    COUNTED_HOOKS(COUNTER_ENUM) CountedHooks
+};
+static const char* const kCountedHookNames[CountedHooks] = { COUNTED_HOOKS(COUNTER_NAME) };
+
+// Calls from threads without a ThreadState (those that were running before the DLL loaded), each on its own cache line
+typedef struct DECLSPEC_ALIGN(64) HookCounter
+{
+    volatile LONG64 calls;
+} HookCounter;
+static HookCounter HookCalls[CountedHooks];
+
+static void CountCall(int hook);
+#    define COUNT_CALL(fn) CountCall(Calls_##fn)
+#else
+#    define COUNT_CALL(fn) ((void)0)
+#endif
+
+// Converts a real affinity mask into the virtual CPUs that we report (see REPORT_MULTIPLIER)
+static ULONG_PTR ExpandMask(ULONG_PTR mask)
+{
+    mask &= kCpuMask;
+#if REPORT_MULTIPLIER > 1
+    ULONG_PTR out = 0;
+    for (unsigned v = 0; v < kReportedCpus; ++v)
+    {
+        if (mask & ((ULONG_PTR)1 << (v % kNumCpus)))
+            out |= (ULONG_PTR)1 << v;
+    }
+    mask = out;
+#endif
+    return mask;
+}
+
+// Converts a mask of virtual CPUs given to us by the application into the real CPUs they run on
+static ULONG_PTR FoldMask(ULONG_PTR mask)
+{
+#if REPORT_MULTIPLIER > 1
+    ULONG_PTR out = 0;
+    mask &= kReportedMask;
+    for (unsigned v = 0; v < kReportedCpus; ++v)
+    {
+        if (mask & ((ULONG_PTR)1 << v))
+            out |= (ULONG_PTR)1 << (v % kNumCpus);
+    }
+    return out;
+#else
+    return mask & kCpuMask;
+#endif
+}
+
+#if JOBSERVER
+static HANDLE JobserverSemaphore;
+static bool JobserverRoot;
+static volatile LONG JobserverTokens; // Tokens held by this process, not counting the implicit one
+static volatile LONG64 JobserverLastTopUp;
+
+// Finds an existing jobserver in MAKEFLAGS, or creates one and advertises it to child processes.
+static void InitJobserver()
+{
+    char makeflags[4096] = "", name[MAX_PATH];
+    const char* auth;
+    DWORD len = GetEnvironmentVariableA("MAKEFLAGS", makeflags, sizeof(makeflags));
+
+    if (len >= sizeof(makeflags))
+    {
+        Log("InitJobserver: MAKEFLAGS too long (%u)", len);
+        return;
+    }
+
+    if ((auth = strstr(makeflags, "--jobserver-auth=")) != NULL)
+    {
+        size_t n = strcspn(auth += 17, " ");
+        if (n >= sizeof(name))
+            return;
+        memcpy(name, auth, n);
+        name[n] = '\0';
+
+        // On Windows, GNU make's jobserver is a named semaphore. Anything else (e.g. fifo:) is a foreign jobserver.
+        JobserverSemaphore = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+        if (!JobserverSemaphore)
+            Log("InitJobserver: OpenSemaphore(%s) failed GLE=%u; not participating", name, GetLastError());
+        else
+            Log("InitJobserver: joined jobserver %s", name);
+        return;
+    }
+
+    if (kNumCpus < 2)
+        return;
+
+    snprintf(name, sizeof(name), "cpulimiter_jobserver_%u", GetCurrentProcessId());
+    JobserverSemaphore = CreateSemaphoreA(NULL, (LONG)kNumCpus - 1, (LONG)kNumCpus - 1, name);
+    if (!JobserverSemaphore)
+    {
+        Log("InitJobserver: CreateSemaphore(%s) failed GLE=%u", name, GetLastError());
+        return;
+    }
+    JobserverRoot = true;
+
+    len = (DWORD)strlen(makeflags);
+    snprintf(makeflags + len, sizeof(makeflags) - len, "%s-j%u --jobserver-auth=%s", len ? " " : "", kNumCpus, name);
+    SetEnvironmentVariableA("MAKEFLAGS", makeflags);
+    Log("InitJobserver: created jobserver %s with %u tokens", name, kNumCpus - 1);
+}
+
+// Takes whatever free tokens are available (without blocking), at most once a second and by one thread at a time.
+static void TopUpJobserverTokens()
+{
+    LONG64 now = (LONG64)GetTickCount64(), last = JobserverLastTopUp;
+
+    if (now - last < 1000 || InterlockedCompareExchange64(&JobserverLastTopUp, now, last) != last)
+        return;
+
+    while ((unsigned)JobserverTokens + 1 < kNumCpus && WaitForSingleObject(JobserverSemaphore, 0) == WAIT_OBJECT_0)
+        InterlockedIncrement(&JobserverTokens);
+}
+
+// Matches the tokens held to the CPU time the process used over the last `seconds`: tokens it didn't use go back to the
+// pool, and one more is taken when it used all it had. Service thread only.
+static void BalanceJobserverTokens(double seconds)
+{
+    static ULONG64 lastCpuTime;
+    FILETIME creation, exit, kernel, user;
+    ULONG64 cpuTime;
+    double busy;
+    LONG held = JobserverTokens, needed;
+
+    if (!JobserverSemaphore || JobserverRoot || !GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return;
+    cpuTime = ((ULONG64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+              ((ULONG64)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    busy = lastCpuTime && seconds > 0.0 ? (double)(cpuTime - lastCpuTime) / (seconds * 1e7) : 0.0;
+    lastCpuTime = cpuTime;
+    if (seconds <= 0.0)
+        return;
+
+    // CPUs' worth of work (a CPU counts once it is a quarter used), less the implicit token
+    needed = max((LONG)(busy + 0.75) - 1, 0);
+    if (held > needed)
+    {
+        InterlockedExchangeAdd(&JobserverTokens, needed - held);
+        ReleaseSemaphore(JobserverSemaphore, held - needed, NULL);
+        Log("Jobserver: %.2f CPUs busy, returned %d tokens", busy, held - needed);
+    }
+    else if (busy >= held + 0.75 && (unsigned)held + 1 < kNumCpus &&
+             WaitForSingleObject(JobserverSemaphore, 0) == WAIT_OBJECT_0)
+        InterlockedIncrement(&JobserverTokens);
+}
+
+static void ReleaseJobserver()
+{
+    if (!JobserverSemaphore)
+        return;
+    if (JobserverTokens)
+        ReleaseSemaphore(JobserverSemaphore, JobserverTokens, NULL);
+    JobserverTokens = 0;
+    CloseHandle(JobserverSemaphore);
+    JobserverSemaphore = NULL;
+}
+#endif
+
+// The number of CPUs that the process is being told it has, given the real count. Takes no jobserver tokens, so it is
+// what reporting uses.
+static DWORD ReportedCpuCount(DWORD count)
+{
+    count = min(count, kNumCpus);
+#if JOBSERVER
+    if (JobserverSemaphore && !JobserverRoot)
+        count = min(count, 1 + (DWORD)JobserverTokens);
+#endif
+    return min(count * REPORT_MULTIPLIER, kReportedCpus);
+}
+
+// The number of CPUs that we tell the process it has, given the real count. A process that asks may be about to size
+// a pool, so free jobserver tokens are taken first.
+static DWORD LimitCpuCount(DWORD count)
+{
+#if JOBSERVER
+    if (JobserverSemaphore && !JobserverRoot)
+        TopUpJobserverTokens();
+#endif
+    return ReportedCpuCount(count);
+}
+
 static void WINAPI MyGetSystemInfo(LPSYSTEM_INFO pinfo)
 {
     static bool called;
 
+    COUNT_CALL(GetSystemInfo);
     OrigGetSystemInfo(pinfo);
     if (!called)
     {
         called = true;
         Log("GetSystemInfo called at least once; orig processors: %u", pinfo->dwNumberOfProcessors);
     }
-    pinfo->dwNumberOfProcessors = min(pinfo->dwNumberOfProcessors, kNumCpus);
+    pinfo->dwNumberOfProcessors = LimitCpuCount(pinfo->dwNumberOfProcessors);
 }
 
 static void WINAPI MyGetNativeSystemInfo(LPSYSTEM_INFO pinfo)
 {
     static bool called;
 
+    COUNT_CALL(GetNativeSystemInfo);
     OrigGetNativeSystemInfo(pinfo);
     if (!called)
     {
         called = true;
         Log("GetNativeSystemInfo called at least once; orig processors: % u", pinfo->dwNumberOfProcessors);
     }
-    pinfo->dwNumberOfProcessors = min(pinfo->dwNumberOfProcessors, kNumCpus);
+    pinfo->dwNumberOfProcessors = LimitCpuCount(pinfo->dwNumberOfProcessors);
+}
+
+// Allocators and runtimes (jemalloc, tcmalloc, the CRT's concurrency runtime, ...) size their per-CPU arenas and caches
+// from these as often as from GetSystemInfo. Like the rest of the hooks, we only expose processor group 0.
+static DWORD WINAPI MyGetActiveProcessorCount(WORD GroupNumber)
+{
+    static bool called;
+
+    COUNT_CALL(GetActiveProcessorCount);
+    DWORD retval = OrigGetActiveProcessorCount(GroupNumber);
+    if (!called)
+    {
+        called = true;
+        Log("GetActiveProcessorCount called at least once, first: (%u) returned %u", GroupNumber, retval);
+    }
+    if (GroupNumber != 0 && GroupNumber != ALL_PROCESSOR_GROUPS)
+        return 0;
+    return LimitCpuCount(retval);
+}
+
+static DWORD WINAPI MyGetMaximumProcessorCount(WORD GroupNumber)
+{
+    static bool called;
+
+    COUNT_CALL(GetMaximumProcessorCount);
+    DWORD retval = OrigGetMaximumProcessorCount(GroupNumber);
+    if (!called)
+    {
+        called = true;
+        Log("GetMaximumProcessorCount called at least once, first: (%u) returned %u", GroupNumber, retval);
+    }
+    if (GroupNumber != 0 && GroupNumber != ALL_PROCESSOR_GROUPS)
+        return 0;
+    return LimitCpuCount(retval);
+}
+
+static WORD WINAPI MyGetActiveProcessorGroupCount()
+{
+    COUNT_CALL(GetActiveProcessorGroupCount);
+    return min(OrigGetActiveProcessorGroupCount(), 1);
+}
+
+static WORD WINAPI MyGetMaximumProcessorGroupCount()
+{
+    COUNT_CALL(GetMaximumProcessorGroupCount);
+    return min(OrigGetMaximumProcessorGroupCount(), 1);
 }
 
 static BOOL MyGetProcessAffinityMask(HANDLE hProcess, PDWORD_PTR lpProcessAffinityMask, PDWORD_PTR lpSystemAffinityMask)
 {
     static bool called;
 
+    COUNT_CALL(GetProcessAffinityMask);
     BOOL retval = OrigGetProcessAffinityMask(hProcess, lpProcessAffinityMask, lpSystemAffinityMask);
     if (!called)
     {
@@ -156,11 +688,11 @@ static BOOL MyGetProcessAffinityMask(HANDLE hProcess, PDWORD_PTR lpProcessAffini
     {
         if (lpProcessAffinityMask)
         {
-            *lpProcessAffinityMask &= kCpuMask;
+            *lpProcessAffinityMask = ExpandMask(*lpProcessAffinityMask);
         }
         if (lpSystemAffinityMask)
         {
-            *lpSystemAffinityMask &= kCpuMask;
+            *lpSystemAffinityMask = ExpandMask(*lpSystemAffinityMask);
         }
     }
     return retval;
@@ -169,8 +701,9 @@ static BOOL MyGetProcessAffinityMask(HANDLE hProcess, PDWORD_PTR lpProcessAffini
 static BOOL MySetProcessAffinityMask(HANDLE hProcess, DWORD_PTR dwProcessAffinityMask)
 {
     static bool called;
-    DWORD_PTR myAffinityMask = dwProcessAffinityMask & kCpuMask;
+    DWORD_PTR myAffinityMask = FoldMask(dwProcessAffinityMask);
 
+    COUNT_CALL(SetProcessAffinityMask);
     BOOL retval = OrigSetProcessAffinityMask(hProcess, myAffinityMask);
     if (!called)
     {
@@ -184,8 +717,9 @@ static BOOL MySetProcessAffinityMask(HANDLE hProcess, DWORD_PTR dwProcessAffinit
 static DWORD_PTR MySetThreadAffinityMask(HANDLE hThread, DWORD_PTR dwThreadAffinityMask)
 {
     static bool called;
-    DWORD_PTR myAffinityMask = dwThreadAffinityMask & kCpuMask;
+    DWORD_PTR myAffinityMask = FoldMask(dwThreadAffinityMask);
 
+    COUNT_CALL(SetThreadAffinityMask);
     DWORD_PTR retval = OrigSetThreadAffinityMask(hThread, myAffinityMask);
     if (!called)
     {
@@ -194,13 +728,14 @@ static DWORD_PTR MySetThreadAffinityMask(HANDLE hThread, DWORD_PTR dwThreadAffin
             dwThreadAffinityMask, retval, GetLastError());
     }
 
-    retval &= kCpuMask;
+    retval = ExpandMask(retval);
 
     return retval;
 }
 
 static BOOL MyGetProcessGroupAffinity(HANDLE hProcess, PUSHORT GroupCount, PUSHORT GroupArray)
 {
+    COUNT_CALL(GetProcessGroupAffinity);
     // Just logging for now
     BOOL retval = OrigGetProcessGroupAffinity(hProcess, GroupCount, GroupArray);
     Log("GetProcessGroupAffinity(%p, %p, %p) returned %s (GroupCount = %u) (GLE=%u)", hProcess, GroupCount, GroupArray,
@@ -210,9 +745,11 @@ static BOOL MyGetProcessGroupAffinity(HANDLE hProcess, PUSHORT GroupCount, PUSHO
 
 static BOOL MyGetThreadGroupAffinity(HANDLE hThread, PGROUP_AFFINITY GroupAffinity)
 {
-    // Just logging for now
+    COUNT_CALL(GetThreadGroupAffinity);
     BOOL retval = OrigGetThreadGroupAffinity(hThread, GroupAffinity);
     Log("GetThreadGroupAffinity(%p, %p) returned %s (GLE=%u)", hThread, GroupAffinity, boolstr(retval), GetLastError());
+    if (retval && GroupAffinity->Group == 0)
+        GroupAffinity->Mask = ExpandMask(GroupAffinity->Mask);
     return retval;
 }
 
@@ -220,10 +757,21 @@ static BOOL MySetThreadGroupAffinity(HANDLE hThread,
                                      const GROUP_AFFINITY* GroupAffinity,
                                      PGROUP_AFFINITY PreviousGroupAffinity)
 {
-    // Just logging for now
+    GROUP_AFFINITY myAffinity;
+
+    COUNT_CALL(SetThreadGroupAffinity);
+    // Only group 0 holds the CPUs we limit to (and report); masks for other groups are passed through
+    if (GroupAffinity && GroupAffinity->Group == 0)
+    {
+        myAffinity = *GroupAffinity;
+        myAffinity.Mask = FoldMask(myAffinity.Mask);
+        GroupAffinity = &myAffinity;
+    }
     BOOL retval = OrigSetThreadGroupAffinity(hThread, GroupAffinity, PreviousGroupAffinity);
     Log("SetThreadGroupAffinity(%p, %p, %p) returned %s (GLE=%u)", hThread, GroupAffinity, PreviousGroupAffinity,
         boolstr(retval), GetLastError());
+    if (retval && PreviousGroupAffinity && PreviousGroupAffinity->Group == 0)
+        PreviousGroupAffinity->Mask = ExpandMask(PreviousGroupAffinity->Mask);
     return retval;
 }
 
@@ -231,10 +779,12 @@ static DWORD MySetThreadIdealProcessor(HANDLE hThread, DWORD dwIdealProcessor)
 {
     static bool called;
 
-    if (dwIdealProcessor >= kNumCpus && dwIdealProcessor != MAXIMUM_PROCESSORS)
+    COUNT_CALL(SetThreadIdealProcessor);
+    if (dwIdealProcessor >= kReportedCpus && dwIdealProcessor != MAXIMUM_PROCESSORS)
         return (DWORD)-1;
 
-    DWORD retval = OrigSetThreadIdealProcessor(hThread, dwIdealProcessor);
+    DWORD retval = OrigSetThreadIdealProcessor(
+        hThread, dwIdealProcessor == MAXIMUM_PROCESSORS ? dwIdealProcessor : dwIdealProcessor % kNumCpus);
     if (!called)
     {
         called = true;
@@ -251,9 +801,26 @@ static BOOL MySetThreadIdealProcessorEx(HANDLE hThread,
                                         PPROCESSOR_NUMBER lpIdealProcessor,
                                         PPROCESSOR_NUMBER lpPreviousIdealProcessor)
 {
+    PROCESSOR_NUMBER myIdeal;
+
+    COUNT_CALL(SetThreadIdealProcessorEx);
+    // Same as SetThreadIdealProcessor: reject numbers past what we report and fold the rest onto the real CPUs
+    if (lpIdealProcessor && lpIdealProcessor->Group == 0)
+    {
+        if (lpIdealProcessor->Number >= kReportedCpus)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        myIdeal = *lpIdealProcessor;
+        myIdeal.Number %= kNumCpus;
+        lpIdealProcessor = &myIdeal;
+    }
     BOOL retval = OrigSetThreadIdealProcessorEx(hThread, lpIdealProcessor, lpPreviousIdealProcessor);
     Log("SetThreadIdealProcessorEx(%p, %p, %p) returned %s (GLE=%u)", hThread, lpIdealProcessor,
-        lpPreviousIdealProcessor);
+        lpPreviousIdealProcessor, boolstr(retval), GetLastError());
+    if (retval && lpPreviousIdealProcessor && lpPreviousIdealProcessor->Group == 0)
+        lpPreviousIdealProcessor->Number %= kNumCpus;
     return retval;
 }
 
@@ -371,87 +938,472 @@ static LogLogicalProcessorInformationEx(const char* name,
 #endif
 }
 
+#if WINE_TOPOLOGY
+// Topology of the Linux host when running under Wine, built once from sysfs by InitWineTopology. NULL otherwise, or if
+// sysfs couldn't be read, in which case Wine's answer is used as-is.
+static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION WineCPUInfo;
+static DWORD WineCPUInfoCount;
+static ULONG_PTR WineOnlineMask;
+static BYTE WineEfficiencyClass[sizeof(ULONG_PTR) * 8];
 
-static SRWLOCK CPUInfoLock = SRWLOCK_INIT;
+#    define WINE_MAX_CPUS (sizeof(ULONG_PTR) * 8)
 
-// Information from GetLogicalProcessorInformation is cached once and always the same (CPUInfoLock is hold only for
-// creation/destruction).
-static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION CachedCPUInfo;
-static DWORD CachedCPUInfoCount;
+// Reads a small file from the host's /sys/devices (through Z:) as a NUL-terminated string
+static int ReadHostPath(void* context, const char* path, char* buf, size_t size)
+{
+    WCHAR wide[MAX_PATH];
+    HANDLE hFile;
+    DWORD read = 0;
+    BOOL ok;
 
-// Information from GetLogicalProcessorInformationEx can change depending on the requested relationship, and therefore
-// will be cached based on the requested relationship (CPUInfoLock must be held for use).
-static LOGICAL_PROCESSOR_RELATIONSHIP CachedRelationship = (LOGICAL_PROCESSOR_RELATIONSHIP)-1;
-static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX CachedCPUInfoEx;
-static DWORD CachedCPUInfoExBytes;
+    if (swprintf_s(wide, _countof(wide), L"Z:\\sys\\devices\\%hs", path) < 0)
+        return 0;
+    for (WCHAR* c = wide; *c; ++c)
+        if (*c == L'/')
+            *c = L'\\';
 
-// Request info from GetLogicalProcessorInformation and cache/filter it for our fake number of CPUs
-static BOOL CacheCPUInfo()
+    hFile = CreateFileW(wide, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return 0;
+    ok = ReadFile(hFile, buf, (DWORD)size - 1, &read, NULL);
+    CloseHandle(hFile);
+    buf[ok ? read : 0] = '\0';
+    return ok && read;
+}
+
+static const SysfsReader HostSysfs = { ReadHostPath, NULL };
+
+// ReadHostPath with a printf-style path
+static bool ReadHostFile(char* buf, DWORD size, const char* format, ...)
 {
-    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION buf, write, read, end;
-    DWORD length = 0;
+    char path[MAX_PATH];
+    va_list ap;
 
-    if (OrigGetLogicalProcessorInformation(NULL, &length) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
-    {
-        Log("CacheCPUInfo: GetLogicalProcessorInformation failed GLE=%u", GetLastError());
-        return FALSE;
-    }
+    va_start(ap, format);
+    vsprintf_s(path, _countof(path), format, ap);
+    va_end(ap);
+    return ReadHostPath(NULL, path, buf, size);
+}
 
-    buf = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)_alloca(length);
-    if (!OrigGetLogicalProcessorInformation(buf, &length))
+// Parses a sysfs CPU list such as "0-3,8-11" into a mask
+static ULONG_PTR ParseCpuList(const char* list)
+{
+    return (ULONG_PTR)SysfsParseCpuList(list, WINE_MAX_CPUS);
+}
+
+static unsigned LowestCpu(ULONG_PTR mask)
+{
+    unsigned long index = 0;
+#    ifdef _WIN64
+    _BitScanForward64(&index, mask);
+#    else
+    _BitScanForward(&index, mask);
+#    endif
+    return index;
+}
+
+// Fills in the cache entries that `cpu` is the lowest-numbered CPU of. Returns the number added.
+static DWORD ReadHostCaches(unsigned cpu, PSYSTEM_LOGICAL_PROCESSOR_INFORMATION out)
+{
+    SysfsCache caches[SYSFS_MAX_CACHES];
+    unsigned count = SysfsReadCaches(&HostSysfs, cpu, WineOnlineMask, WINE_MAX_CPUS, caches);
+
+    for (unsigned i = 0; i < count; ++i)
     {
-        Log("CacheCPUInfo: GetLogicalProcessorInformation failed GLE=%u", GetLastError());
-        return FALSE;
+        out[i].Relationship = RelationCache;
+        out[i].ProcessorMask = (ULONG_PTR)caches[i].mask;
+        out[i].Cache.Level = caches[i].level;
+        out[i].Cache.Associativity = caches[i].associativity;
+        out[i].Cache.LineSize = caches[i].lineSize;
+        out[i].Cache.Size = caches[i].size;
+        out[i].Cache.Type = (PROCESSOR_CACHE_TYPE)caches[i].type;
     }
+    return count;
+}
 
-    LogLogicalProcessorInformation("Before processing", buf, length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+// Under Wine, builds WineCPUInfo from the host's sysfs: a core entry per SMT sibling set, a package entry per set of
+// core siblings, the caches under each CPU, and the NUMA nodes. Hybrid hosts list their efficient cores in
+// /sys/devices/cpu_atom/cpus; the others get the higher EfficiencyClass, as on Windows. This opens several files per
+// CPU, so it runs on the first topology query (QueryCPUInfo/QueryCPUInfoEx) rather than under the loader lock.
+static INIT_ONCE WineTopologyOnce = INIT_ONCE_STATIC_INIT;
 
-    // Only allow CPUs that are within our mask
-    end = buf + (length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
-    write = read = buf;
+static BOOL CALLBACK InitWineTopology(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    typedef const char*(CDECL * wine_get_version_t)(void);
+    wine_get_version_t wine_get_version =
+        (wine_get_version_t)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "wine_get_version");
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION info;
+    ULONG_PTR atoms = 0, mask;
+    DWORD count = 0;
+    char text[256];
 
-    // Walk through all of the returned data and filter it. Any entries that are about CPUs not in our limited set are
-    // culled. Entries that do reference our limited set are trimmed down to ensure that it's *only* about our set.
-    for (; read < end; ++read)
+    if (!wine_get_version)
+        return TRUE;
+    Log("InitWineTopology: running under Wine %s", wine_get_version());
+
+    if (!ReadHostFile(text, sizeof(text), "system/cpu/online") || !(WineOnlineMask = ParseCpuList(text)))
     {
-        if (read->ProcessorMask & kCpuMask)
-        {
-            read->ProcessorMask &= kCpuMask;
-            if (read != write)
-            {
-                memcpy(write, read, sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
-            }
-            ++write;
-        }
+        Log("InitWineTopology: host sysfs isn't reachable through Z:; using Wine's topology");
+        return TRUE;
     }
+    // A core, a package and the caches per CPU at most, plus the NUMA nodes
+    info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)HeapAlloc(
+        GetProcessHeap(), HEAP_ZERO_MEMORY, WINE_MAX_CPUS * (3 + SYSFS_MAX_CACHES) * sizeof(*info));
+    if (!info)
+        return TRUE;
+    if (ReadHostFile(text, sizeof(text), "cpu_atom/cpus"))
+        atoms = ParseCpuList(text);
 
-    LogLogicalProcessorInformation("After processing", buf, (DWORD)(write - buf));
-
-    AcquireSRWLockExclusive(&CPUInfoLock);
-    if (!CachedCPUInfo)
+    for (unsigned cpu = 0; cpu < WINE_MAX_CPUS; ++cpu)
     {
-        CachedCPUInfo =
-            (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)write - (SIZE_T)buf);
-        if (!CachedCPUInfo)
+        ULONG_PTR bit = (ULONG_PTR)1 << cpu;
+        if (!(WineOnlineMask & bit))
+            continue;
+        WineEfficiencyClass[cpu] = atoms && !(atoms & bit) ? 1 : 0;
+
+        // Each entry is added by the lowest-numbered online CPU it covers, so that there are no duplicates
+        if (ReadHostFile(text, sizeof(text), "system/cpu/cpu%u/topology/thread_siblings_list", cpu) &&
+            (mask = ParseCpuList(text) & WineOnlineMask) && LowestCpu(mask) == cpu)
         {
-            ReleaseSRWLockExclusive(&CPUInfoLock);
-            return FALSE;
+            info[count].Relationship = RelationProcessorCore;
+            info[count].ProcessorMask = mask;
+            info[count++].ProcessorCore.Flags = mask != bit ? LTP_PC_SMT : 0;
+        }
+        if (ReadHostFile(text, sizeof(text), "system/cpu/cpu%u/topology/core_siblings_list", cpu) &&
+            (mask = ParseCpuList(text) & WineOnlineMask) && LowestCpu(mask) == cpu)
+        {
+            info[count].Relationship = RelationProcessorPackage;
+            info[count++].ProcessorMask = mask;
         }
+        count += ReadHostCaches(cpu, info + count);
+    }
 
-        CachedCPUInfoCount = (DWORD)(write - buf);
-        memcpy(CachedCPUInfo, buf, CachedCPUInfoCount * sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    for (unsigned node = 0; node < WINE_MAX_CPUS; ++node)
+    {
+        if (!ReadHostFile(text, sizeof(text), "system/node/node%u/cpulist", node) ||
+            !(mask = ParseCpuList(text) & WineOnlineMask))
+            continue;
+        info[count].Relationship = RelationNumaNode;
+        info[count].ProcessorMask = mask;
+        info[count++].NumaNode.NodeNumber = node;
+    }
+    // Kernels without NUMA support have no node directory; everything is node 0 then
+    if (!ReadHostFile(text, sizeof(text), "system/node/online"))
+    {
+        info[count].Relationship = RelationNumaNode;
+        info[count++].ProcessorMask = WineOnlineMask;
     }
 
-    ReleaseSRWLockExclusive(&CPUInfoLock);
+    // Every online CPU must be in a core entry, or the policies would never use it
+    mask = WineOnlineMask;
+
+    for (DWORD i = 0; i < count && mask; ++i)
+        if (info[i].Relationship == RelationProcessorCore)
+            mask &= ~info[i].ProcessorMask;
+    if (mask)
+    {
+        Log("InitWineTopology: host sysfs doesn't describe every core; using Wine's topology");
+        HeapFree(GetProcessHeap(), 0, info);
+        return TRUE;
+    }
+
+    LogLogicalProcessorInformation("Host sysfs", info, count);
+    WineCPUInfo = info;
+    WineCPUInfoCount = count;
     return TRUE;
 }
 
-// Request info from GetLogicalProcessorInformationEx based on the given Relationship and cache/filter it for our fake
-// number of CPUs
-static BOOL CacheCPUInfoExLocked(LOGICAL_PROCESSOR_RELATIONSHIP Relationship)
+// Builds GetLogicalProcessorInformationEx output for `Relationship` from WineCPUInfo, with the same semantics
+static BOOL WineCPUInfoEx(LOGICAL_PROCESSOR_RELATIONSHIP Relationship,
+                          PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Buffer,
+                          PDWORD ReturnedLength)
 {
-    DWORD length = 0, size;
-    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX buf, read, write, next, end;
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX entry;
+    DWORD needed = 0;
+
+    // The extra pass adds the group entry
+    for (DWORD i = 0; i <= WineCPUInfoCount; ++i)
+    {
+        memset(&entry, 0, sizeof(entry));
+        if (i == WineCPUInfoCount)
+        {
+            entry.Relationship = RelationGroup;
+            entry.Group.MaximumGroupCount = entry.Group.ActiveGroupCount = 1;
+            entry.Group.GroupInfo[0].ActiveProcessorMask = WineOnlineMask;
+            for (ULONG_PTR bits = WineOnlineMask; bits; bits &= bits - 1)
+                ++entry.Group.GroupInfo[0].ActiveProcessorCount;
+            entry.Group.GroupInfo[0].MaximumProcessorCount = entry.Group.GroupInfo[0].ActiveProcessorCount;
+            entry.Size = (DWORD)((PBYTE)&entry.Group.GroupInfo[1] - (PBYTE)&entry);
+        }
+        else
+        {
+            const SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info = &WineCPUInfo[i];
+            entry.Relationship = info->Relationship;
+            switch (info->Relationship)
+            {
+                case RelationProcessorCore:
+                    entry.Processor.Flags = info->ProcessorCore.Flags;
+                    entry.Processor.EfficiencyClass = WineEfficiencyClass[LowestCpu(info->ProcessorMask)];
+                    // fall through
+                case RelationProcessorPackage:
+                    entry.Processor.GroupCount = 1;
+                    entry.Processor.GroupMask[0].Mask = info->ProcessorMask;
+                    entry.Size = (DWORD)((PBYTE)&entry.Processor.GroupMask[1] - (PBYTE)&entry);
+                    break;
+                case RelationNumaNode:
+                    entry.NumaNode.NodeNumber = info->NumaNode.NodeNumber;
+                    entry.NumaNode.GroupCount = 1;
+                    entry.NumaNode.GroupMask.Mask = info->ProcessorMask;
+                    entry.Size = (DWORD)((PBYTE)&entry.NumaNode.GroupMasks[1] - (PBYTE)&entry);
+                    break;
+                case RelationCache:
+                    entry.Cache.Level = info->Cache.Level;
+                    entry.Cache.Associativity = info->Cache.Associativity;
+                    entry.Cache.LineSize = info->Cache.LineSize;
+                    entry.Cache.CacheSize = info->Cache.Size;
+                    entry.Cache.Type = info->Cache.Type;
+                    entry.Cache.GroupCount = 1;
+                    entry.Cache.GroupMask.Mask = info->ProcessorMask;
+                    entry.Size = (DWORD)((PBYTE)&entry.Cache.GroupMasks[1] - (PBYTE)&entry);
+                    break;
+                default:
+                    continue;
+            }
+        }
+
+        if (Relationship != RelationAll && Relationship != entry.Relationship &&
+            !(Relationship == RelationNumaNodeEx && entry.Relationship == RelationNumaNode))
+            continue;
+        if (Relationship == RelationNumaNodeEx && entry.Relationship == RelationNumaNode)
+            entry.Relationship = RelationNumaNodeEx;
+        if (Buffer && needed + entry.Size <= *ReturnedLength)
+            memcpy((PBYTE)Buffer + needed, &entry, entry.Size);
+        needed += entry.Size;
+    }
+
+    if (!Buffer || needed > *ReturnedLength)
+    {
+        *ReturnedLength = needed;
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    *ReturnedLength = needed;
+    return TRUE;
+}
+#endif
+
+// GetLogicalProcessorInformation for the machine, from the host under Wine
+static BOOL QueryCPUInfo(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION Buffer, PDWORD ReturnedLength)
+{
+#if WINE_TOPOLOGY
+    InitOnceExecuteOnce(&WineTopologyOnce, InitWineTopology, NULL, NULL);
+    if (WineCPUInfo)
+    {
+        DWORD needed = WineCPUInfoCount * sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+        if (!Buffer || *ReturnedLength < needed)
+        {
+            *ReturnedLength = needed;
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        memcpy(Buffer, WineCPUInfo, needed);
+        *ReturnedLength = needed;
+        return TRUE;
+    }
+#endif
+    return OrigGetLogicalProcessorInformation(Buffer, ReturnedLength);
+}
+
+// GetLogicalProcessorInformationEx for the machine, from the host under Wine
+static BOOL QueryCPUInfoEx(LOGICAL_PROCESSOR_RELATIONSHIP Relationship,
+                           PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Buffer,
+                           PDWORD ReturnedLength)
+{
+#if WINE_TOPOLOGY
+    InitOnceExecuteOnce(&WineTopologyOnce, InitWineTopology, NULL, NULL);
+    if (WineCPUInfo)
+        return WineCPUInfoEx(Relationship, Buffer, ReturnedLength);
+#endif
+    return OrigGetLogicalProcessorInformationEx(Relationship, Buffer, ReturnedLength);
+}
+
+static SRWLOCK CPUInfoLock = SRWLOCK_INIT;
+
+// Information from GetLogicalProcessorInformation is cached once and always the same (CPUInfoLock is hold only for
+// creation/destruction).
+static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION CachedCPUInfo;
+static DWORD CachedCPUInfoCount;
+
+// Information from GetLogicalProcessorInformationEx can change depending on the requested relationship, and therefore
+// will be cached based on the requested relationship (CPUInfoLock must be held for use).
+static LOGICAL_PROCESSOR_RELATIONSHIP CachedRelationship = (LOGICAL_PROCESSOR_RELATIONSHIP)-1;
+static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX CachedCPUInfoEx;
+static DWORD CachedCPUInfoExBytes;
+
+#if REPORT_MULTIPLIER > 1
+// Per-CPU entries (cores and caches) are repeated for each set of virtual CPUs, shifted up by NUM_CPUS each time.
+// Entries that span CPUs (NUMA nodes, packages) get their mask expanded instead so that they stay unique.
+static ULONG_PTR ShiftReplica(ULONG_PTR mask, unsigned replica)
+{
+    unsigned shift = replica * kNumCpus;
+    return shift >= 64 ? 0 : (mask << shift) & kReportedMask;
+}
+
+// Expands `count` filtered entries in place; `info` must have room for count * REPORT_MULTIPLIER entries.
+static DWORD ExpandCPUInfo(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION info, DWORD count)
+{
+    DWORD out = count;
+
+    for (DWORD i = 0; i < count; ++i)
+    {
+        if (info[i].Relationship != RelationProcessorCore && info[i].Relationship != RelationCache)
+        {
+            info[i].ProcessorMask = ExpandMask(info[i].ProcessorMask);
+            continue;
+        }
+        for (unsigned r = 1; r < REPORT_MULTIPLIER; ++r)
+        {
+            ULONG_PTR mask = ShiftReplica(info[i].ProcessorMask, r);
+            if (!mask)
+                break;
+            info[out] = info[i];
+            info[out++].ProcessorMask = mask;
+        }
+    }
+    return out;
+}
+
+// Expands `bytes` of filtered entries from `src` into `dst`, which must have room for bytes * REPORT_MULTIPLIER.
+static DWORD ExpandCPUInfoEx(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX src,
+                             DWORD bytes,
+                             PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX dst)
+{
+    PBYTE read = (PBYTE)src, end = read + bytes, write = (PBYTE)dst;
+
+    for (; read < end; read += ((PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)read)->Size)
+    {
+        PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX in = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)read;
+        PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX out = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)write;
+        KAFFINITY* mask = NULL;
+
+        memcpy(write, read, in->Size);
+        write += in->Size;
+
+        switch (in->Relationship)
+        {
+            case RelationProcessorCore:
+                mask = &out->Processor.GroupMask[0].Mask;
+                break;
+            case RelationCache:
+                mask = &out->Cache.GroupMask.Mask;
+                break;
+            case RelationProcessorDie:
+            case RelationProcessorModule:
+            case RelationProcessorPackage:
+                out->Processor.GroupMask[0].Mask = ExpandMask(out->Processor.GroupMask[0].Mask);
+                break;
+            case RelationNumaNode:
+            case RelationNumaNodeEx:
+                out->NumaNode.GroupMask.Mask = ExpandMask(out->NumaNode.GroupMask.Mask);
+                break;
+            case RelationGroup:
+                out->Group.GroupInfo[0].ActiveProcessorMask = ExpandMask(out->Group.GroupInfo[0].ActiveProcessorMask);
+                out->Group.GroupInfo[0].ActiveProcessorCount =
+                    (BYTE)min(out->Group.GroupInfo[0].ActiveProcessorCount * REPORT_MULTIPLIER, kReportedCpus);
+                out->Group.GroupInfo[0].MaximumProcessorCount =
+                    (BYTE)min(out->Group.GroupInfo[0].MaximumProcessorCount * REPORT_MULTIPLIER, kReportedCpus);
+                break;
+            default:
+                break;
+        }
+
+        if (!mask)
+            continue;
+        for (unsigned r = 1; r < REPORT_MULTIPLIER; ++r)
+        {
+            PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX replica = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)write;
+            ULONG_PTR shifted = ShiftReplica(*mask, r);
+            if (!shifted)
+                break;
+            memcpy(replica, out, in->Size);
+            *(KAFFINITY*)((PBYTE)replica + ((PBYTE)mask - (PBYTE)out)) = shifted;
+            write += in->Size;
+        }
+    }
+    return (DWORD)(write - (PBYTE)dst);
+}
+#endif
+
+// Request info from GetLogicalProcessorInformation and cache/filter it for our fake number of CPUs
+static BOOL CacheCPUInfo()
+{
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION buf, write, read, end;
+    DWORD length = 0;
+
+    if (QueryCPUInfo(NULL, &length) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    {
+        Log("CacheCPUInfo: GetLogicalProcessorInformation failed GLE=%u", GetLastError());
+        return FALSE;
+    }
+
+    buf = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)_alloca(length);
+    if (!QueryCPUInfo(buf, &length))
+    {
+        Log("CacheCPUInfo: GetLogicalProcessorInformation failed GLE=%u", GetLastError());
+        return FALSE;
+    }
+
+    LogLogicalProcessorInformation("Before processing", buf, length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+
+    // Only allow CPUs that are within our mask
+    end = buf + (length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    write = read = buf;
+
+    // Walk through all of the returned data and filter it. Any entries that are about CPUs not in our limited set are
+    // culled. Entries that do reference our limited set are trimmed down to ensure that it's *only* about our set.
+    for (; read < end; ++read)
+    {
+        if (read->ProcessorMask & kCpuMask)
+        {
+            read->ProcessorMask &= kCpuMask;
+            if (read != write)
+            {
+                memcpy(write, read, sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+            }
+            ++write;
+        }
+    }
+
+    LogLogicalProcessorInformation("After processing", buf, (DWORD)(write - buf));
+
+    AcquireSRWLockExclusive(&CPUInfoLock);
+    if (!CachedCPUInfo)
+    {
+        CachedCPUInfo = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)HeapAlloc(
+            GetProcessHeap(), 0, ((SIZE_T)write - (SIZE_T)buf) * REPORT_MULTIPLIER);
+        if (!CachedCPUInfo)
+        {
+            ReleaseSRWLockExclusive(&CPUInfoLock);
+            return FALSE;
+        }
+
+        CachedCPUInfoCount = (DWORD)(write - buf);
+        memcpy(CachedCPUInfo, buf, CachedCPUInfoCount * sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+#if REPORT_MULTIPLIER > 1
+        CachedCPUInfoCount = ExpandCPUInfo(CachedCPUInfo, CachedCPUInfoCount);
+#endif
+    }
+
+    ReleaseSRWLockExclusive(&CPUInfoLock);
+    return TRUE;
+}
+
+// Request info from GetLogicalProcessorInformationEx based on the given Relationship and cache/filter it for our fake
+// number of CPUs
+static BOOL CacheCPUInfoExLocked(LOGICAL_PROCESSOR_RELATIONSHIP Relationship)
+{
+    DWORD length = 0, size;
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX buf, read, write, next, end;
 
     if (CachedCPUInfoEx)
     {
@@ -461,11 +1413,11 @@ static BOOL CacheCPUInfoExLocked(LOGICAL_PROCESSOR_RELATIONSHIP Relationship)
         CachedCPUInfoExBytes = 0;
     }
 
-    if (OrigGetLogicalProcessorInformationEx(Relationship, NULL, &length) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    if (QueryCPUInfoEx(Relationship, NULL, &length) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
         return FALSE;
 
     buf = write = read = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)_alloca(length);
-    if (!OrigGetLogicalProcessorInformationEx(Relationship, read, &length))
+    if (!QueryCPUInfoEx(Relationship, read, &length))
         return FALSE;
 
     LogLogicalProcessorInformationEx("Before processing", Relationship, read, length);
@@ -544,13 +1496,18 @@ static BOOL CacheCPUInfoExLocked(LOGICAL_PROCESSOR_RELATIONSHIP Relationship)
     }
 
     CachedCPUInfoExBytes = (DWORD)((PBYTE)write - (PBYTE)buf);
-    CachedCPUInfoEx = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)HeapAlloc(GetProcessHeap(), 0, CachedCPUInfoExBytes);
+    CachedCPUInfoEx = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)HeapAlloc(
+        GetProcessHeap(), 0, (SIZE_T)CachedCPUInfoExBytes * REPORT_MULTIPLIER);
     if (!CachedCPUInfoEx)
     {
         CachedCPUInfoExBytes = 0;
         return FALSE;
     }
+#if REPORT_MULTIPLIER > 1
+    CachedCPUInfoExBytes = ExpandCPUInfoEx(buf, CachedCPUInfoExBytes, CachedCPUInfoEx);
+#else
     memcpy(CachedCPUInfoEx, buf, CachedCPUInfoExBytes);
+#endif
     CachedRelationship = Relationship;
 
     LogLogicalProcessorInformationEx("After processing", Relationship, CachedCPUInfoEx, CachedCPUInfoExBytes);
@@ -562,6 +1519,7 @@ static BOOL WINAPI MyGetLogicalProcessorInformation(PSYSTEM_LOGICAL_PROCESSOR_IN
 {
     static bool called;
 
+    COUNT_CALL(GetLogicalProcessorInformation);
     if (!called)
     {
         called = true;
@@ -595,6 +1553,7 @@ static BOOL WINAPI MyGetLogicalProcessorInformationEx(LOGICAL_PROCESSOR_RELATION
 {
     static bool called;
 
+    COUNT_CALL(GetLogicalProcessorInformationEx);
     if (!called)
     {
         called = true;
@@ -631,94 +1590,2692 @@ static BOOL WINAPI MyGetLogicalProcessorInformationEx(LOGICAL_PROCESSOR_RELATION
     return TRUE;
 }
 
-static void InstallDetours()
+// hwloc, oneTBB's tbbbind, the Concurrency Runtime and the like look up each NUMA node's processors directly rather
+// than through GetLogicalProcessorInformationEx, so these have to agree with it: only nodes that have limited CPUs
+// exist, and their masks hold only the CPUs that we report.
+static BOOL WINAPI MyGetNumaHighestNodeNumber(PULONG HighestNodeNumber)
 {
-    LONG err;
-    HINSTANCE hKernel32;
+    static bool called;
+    ULONG highest = 0, limited = 0;
 
-    Log("InstallDetours");
-    if ((err = DetourTransactionBegin()) != NO_ERROR)
-        Log("DetourTransactionBegin failed: %d", err);
-    hKernel32 = GetModuleHandleW(L"Kernel32.dll");
-    if (!hKernel32)
+    COUNT_CALL(GetNumaHighestNodeNumber);
+    if (!HighestNodeNumber)
     {
-        Log("Failed to find Kernel32.dll");
-        DetourTransactionAbort();
-        return;
+        // Do whatever the parent function does with bad input
+        return OrigGetNumaHighestNodeNumber(HighestNodeNumber);
     }
+    if (!OrigGetNumaHighestNodeNumber(&highest))
+        return FALSE;
+    for (ULONG node = 0; node <= highest; ++node)
+    {
+        GROUP_AFFINITY affinity;
+        if (OrigGetNumaNodeProcessorMaskEx((USHORT)node, &affinity) && affinity.Group == 0 &&
+            (affinity.Mask & kCpuMask))
+            limited = node;
+    }
+    if (!called)
+    {
+        called = true;
+        Log("GetNumaHighestNodeNumber called at least once; %u -> %u", highest, limited);
+    }
+    *HighestNodeNumber = limited;
+    return TRUE;
+}
 
-#define HOOK(fn, mod)                                                                                                  \
-    if (!(Orig##fn = (fn##_t)GetProcAddress(mod, #fn)))                                                                \
-        Log("Failed to find " #fn);                                                                                    \
-    if (Orig##fn && (err = DetourAttach((PVOID*)&Orig##fn, (void*)My##fn)) != NO_ERROR)                                \
-    Log("DetourAttach(" #fn ") failed: %d", err)
-
-    HOOK(GetSystemInfo, hKernel32);
-    HOOK(GetNativeSystemInfo, hKernel32);
-    HOOK(GetProcessAffinityMask, hKernel32);
-    HOOK(SetProcessAffinityMask, hKernel32);
-    HOOK(SetThreadAffinityMask, hKernel32);
-    HOOK(GetProcessGroupAffinity, hKernel32);
-    HOOK(GetThreadGroupAffinity, hKernel32);
-    HOOK(SetThreadGroupAffinity, hKernel32);
-    HOOK(SetThreadIdealProcessor, hKernel32);
-    HOOK(SetThreadIdealProcessorEx, hKernel32);
-    HOOK(GetLogicalProcessorInformation, hKernel32);
-    HOOK(GetLogicalProcessorInformationEx, hKernel32);
+static BOOL WINAPI MyGetNumaNodeProcessorMask(UCHAR Node, PULONGLONG ProcessorMask)
+{
+    COUNT_CALL(GetNumaNodeProcessorMask);
+    BOOL retval = OrigGetNumaNodeProcessorMask(Node, ProcessorMask);
+    if (retval)
+        *ProcessorMask = ExpandMask((ULONG_PTR)*ProcessorMask);
+    return retval;
+}
 
-    if ((err = DetourTransactionCommit()) != NO_ERROR)
-        Log("DetourTransactionCommit failed: %d", err);
-    installed = true;
+static BOOL WINAPI MyGetNumaNodeProcessorMaskEx(USHORT Node, PGROUP_AFFINITY ProcessorMask)
+{
+    COUNT_CALL(GetNumaNodeProcessorMaskEx);
+    BOOL retval = OrigGetNumaNodeProcessorMaskEx(Node, ProcessorMask);
+    if (retval)
+    {
+        // We only report group 0
+        ProcessorMask->Mask = ProcessorMask->Group == 0 ? ExpandMask(ProcessorMask->Mask) : 0;
+        ProcessorMask->Group = 0;
+    }
+    return retval;
 }
 
-static void RestoreDetours()
+// A completion port created with a concurrency of 0 lets as many threads run at once as the machine has processors,
+// which the kernel decides without asking GetSystemInfo. I/O servicing threads then crowd the limited CPUs (and each
+// other's caches), so the default is capped at the CPUs threads are placed on. It only ever comes down: on a machine
+// with fewer processors than that, the default stays as it was. Explicit counts are left alone; they were most likely
+// computed from the (already limited) processor count anyway.
+static HANDLE WINAPI MyCreateIoCompletionPort(HANDLE FileHandle,
+                                              HANDLE ExistingCompletionPort,
+                                              ULONG_PTR CompletionKey,
+                                              DWORD NumberOfConcurrentThreads)
 {
-    Log("RestoreDetours installed=%s", installed ? "true" : "false");
-    if (!installed)
-        return;
+    static bool called;
 
-#define UNHOOK(fn)                                                                                                     \
-    if (fn)                                                                                                            \
-    DetourDetach((PVOID*)&Orig##fn, (void*)My##fn)
+    COUNT_CALL(CreateIoCompletionPort);
+    if (!ExistingCompletionPort && !NumberOfConcurrentThreads)
+    {
+        DWORD cpus = 0;
+        for (DWORD_PTR bits = EnforcedMask; bits; bits &= bits - 1)
+            ++cpus;
+        cpus = min(cpus, OrigGetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+        if (!called)
+        {
+            called = true;
+            Log("CreateIoCompletionPort called at least once with the default concurrency; using %u", cpus);
+        }
+        NumberOfConcurrentThreads = cpus;
+    }
+    return OrigCreateIoCompletionPort(FileHandle, ExistingCompletionPort, CompletionKey, NumberOfConcurrentThreads);
+}
 
-    DetourTransactionBegin();
+static volatile LONG LimitedCoreCount = -1; // -1 until GetLimitedCoreCount() has run
 
-    UNHOOK(GetSystemInfo);
-    UNHOOK(GetNativeSystemInfo);
-    UNHOOK(GetProcessAffinityMask);
-    UNHOOK(SetProcessAffinityMask);
-    UNHOOK(SetThreadAffinityMask);
-    UNHOOK(GetProcessGroupAffinity);
-    UNHOOK(GetThreadGroupAffinity);
-    UNHOOK(SetThreadGroupAffinity);
-    UNHOOK(SetThreadIdealProcessor);
-    UNHOOK(SetThreadIdealProcessorEx);
-    UNHOOK(GetLogicalProcessorInformation);
-    UNHOOK(GetLogicalProcessorInformationEx);
+// Number of physical cores (as opposed to logical processors) within our limited set; 0 if unknown. These are the real
+// cores: the copies that REPORT_MULTIPLIER adds to the cached information lie above kCpuMask and aren't counted.
+static DWORD GetLimitedCoreCount()
+{
+    LONG count = 0;
 
-    DetourTransactionCommit();
+    if (LimitedCoreCount >= 0)
+        return (DWORD)LimitedCoreCount;
 
-    // Clean up cached logical processor info
-    AcquireSRWLockExclusive(&CPUInfoLock);
-    if (CachedCPUInfo)
+    if (CachedCPUInfo || CacheCPUInfo())
     {
-        HeapFree(GetProcessHeap(), 0, CachedCPUInfo);
-        CachedCPUInfo = NULL;
-        CachedCPUInfoCount = 0;
-    }
-    if (CachedCPUInfoEx)
-    {
-        HeapFree(GetProcessHeap(), 0, CachedCPUInfoEx);
-        CachedRelationship = (LOGICAL_PROCESSOR_RELATIONSHIP)-1;
-        CachedCPUInfoEx = NULL;
-        CachedCPUInfoExBytes = 0;
+        AcquireSRWLockShared(&CPUInfoLock);
+        for (DWORD i = 0; i < CachedCPUInfoCount; ++i)
+        {
+            if (CachedCPUInfo[i].Relationship == RelationProcessorCore && !(CachedCPUInfo[i].ProcessorMask & ~kCpuMask))
+                ++count;
+        }
+        ReleaseSRWLockShared(&CPUInfoLock);
     }
-    ReleaseSRWLockExclusive(&CPUInfoLock);
-
-    installed = false;
+    InterlockedExchange(&LimitedCoreCount, count);
+    return (DWORD)count;
 }
 
-BOOL WINAPI DllMain(HINSTANCE hInst, DWORD dwReason, LPVOID reserved)
+#if TUNE_SPIN_COUNTS
+// Spin counts are chosen by the application for the machine it thinks it's on. Spinning only pays off when the lock
+// holder is running on another core; with a single CPU it never is, and with SMT the spinner steals cycles from a
+// holder on the sibling. Scale the spin by the fraction of our logical processors that are physical cores.
+static DWORD TuneSpinCount(DWORD dwSpinCount)
+{
+    // The high byte of the spin count carries flags (e.g. RTL_CRITICAL_SECTION_ALL_FLAG_BITS on older Windows)
+    DWORD flags = dwSpinCount & 0xFF000000, spin = dwSpinCount & 0x00FFFFFF;
+    LONG cores = LimitedCoreCount;
+
+    if (!spin)
+        return dwSpinCount;
+    // The real limit, not what is reported: REPORT_MULTIPLIER and jobserver tokens don't add processors to spin on
+    if (kNumCpus <= 1)
+        return flags;
+
+    // Critical sections are mostly set up from DllMain or CRT init, under the loader lock, and under Wine fetching the
+    // topology reads the host's sysfs. So the spin passes through unchanged until WarmSpinTopology() has counted the
+    // cores from a thread pool thread.
+    if (cores < 0)
+        return dwSpinCount;
+    if (cores && (DWORD)cores < kNumCpus)
+        spin = (DWORD)((ULONGLONG)spin * cores / kNumCpus);
+    return flags | spin;
+}
+
+static VOID CALLBACK WarmSpinTopology(PTP_CALLBACK_INSTANCE instance, PVOID context)
+{
+    Log("WarmSpinTopology: %u cores", GetLimitedCoreCount());
+}
+
+static BOOL WINAPI MyInitializeCriticalSectionAndSpinCount(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount)
+{
+    static bool called;
+    DWORD tuned = TuneSpinCount(dwSpinCount);
+
+    COUNT_CALL(InitializeCriticalSectionAndSpinCount);
+    if (!called)
+    {
+        called = true;
+        Log("InitializeCriticalSectionAndSpinCount called at least once, first: spin %x -> %x", dwSpinCount, tuned);
+    }
+    return OrigInitializeCriticalSectionAndSpinCount(lpCriticalSection, tuned);
+}
+
+static BOOL WINAPI MyInitializeCriticalSectionEx(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount, DWORD Flags)
+{
+    static bool called;
+    DWORD tuned = TuneSpinCount(dwSpinCount);
+
+    COUNT_CALL(InitializeCriticalSectionEx);
+    if (!called)
+    {
+        called = true;
+        Log("InitializeCriticalSectionEx called at least once, first: spin %x -> %x flags %x", dwSpinCount, tuned,
+            Flags);
+    }
+    return OrigInitializeCriticalSectionEx(lpCriticalSection, tuned, Flags);
+}
+#endif
+
+#if LIMIT_MEMORY
+// NUMA nodes that have at least one of our CPUs, found once on first use.
+static INIT_ONCE LocalNodesOnce = INIT_ONCE_STATIC_INIT;
+static USHORT LocalNodes[64];
+static ULONG LocalNodeCount;
+static ULONG MemoryNodeCount;
+
+static BOOL CALLBACK InitLocalNodes(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    ULONG highest = 0;
+
+    OrigGetNumaHighestNodeNumber(&highest);
+    for (USHORT node = 0; node <= highest; ++node)
+    {
+        GROUP_AFFINITY affinity;
+        ULONGLONG available;
+
+        // Nodes without memory (or that don't exist) don't count towards the total
+        if (!GetNumaAvailableMemoryNodeEx(node, &available) || !OrigGetNumaNodeProcessorMaskEx(node, &affinity))
+            continue;
+        ++MemoryNodeCount;
+
+        if (affinity.Group == 0 && (affinity.Mask & kCpuMask) && LocalNodeCount < _countof(LocalNodes))
+            LocalNodes[LocalNodeCount++] = node;
+    }
+    Log("NUMA: %u of %u memory nodes are local to the limited CPUs", LocalNodeCount, MemoryNodeCount);
+    return TRUE;
+}
+
+// Scales a total physical memory figure down to the local NUMA nodes and/or MEMORY_CAP_MB. Windows has no per-node
+// total, so the total is split evenly between the nodes that have memory (true of any sanely populated board).
+static ULONGLONG LimitTotalMemory(ULONGLONG bytes)
+{
+#    if NUMA_LOCAL_MEMORY
+    InitOnceExecuteOnce(&LocalNodesOnce, InitLocalNodes, NULL, NULL);
+    if (LocalNodeCount && MemoryNodeCount > LocalNodeCount)
+        bytes = bytes / MemoryNodeCount * LocalNodeCount;
+#    endif
+#    if MEMORY_CAP_MB
+    bytes = min(bytes, (ULONGLONG)MEMORY_CAP_MB * 1024 * 1024);
+#    endif
+    return bytes;
+}
+
+static BOOL WINAPI MyGlobalMemoryStatusEx(LPMEMORYSTATUSEX lpBuffer)
+{
+    static bool called;
+    ULONGLONG total, avail;
+
+    COUNT_CALL(GlobalMemoryStatusEx);
+    BOOL retval = OrigGlobalMemoryStatusEx(lpBuffer);
+    if (!called)
+    {
+        called = true;
+        Log("GlobalMemoryStatusEx called at least once; orig total=%llu avail=%llu",
+            retval ? lpBuffer->ullTotalPhys : 0, retval ? lpBuffer->ullAvailPhys : 0);
+    }
+    if (!retval)
+        return retval;
+
+    total = LimitTotalMemory(lpBuffer->ullTotalPhys);
+    avail = lpBuffer->ullAvailPhys;
+#    if NUMA_LOCAL_MEMORY
+    if (LocalNodeCount && MemoryNodeCount > LocalNodeCount)
+    {
+        avail = 0;
+        for (ULONG i = 0; i < LocalNodeCount; ++i)
+        {
+            ULONGLONG nodeAvail;
+            if (GetNumaAvailableMemoryNodeEx(LocalNodes[i], &nodeAvail))
+                avail += nodeAvail;
+        }
+    }
+#    endif
+    avail = min(avail, total);
+
+    lpBuffer->ullTotalPhys = total;
+    lpBuffer->ullAvailPhys = avail;
+    if (total)
+        lpBuffer->dwMemoryLoad = (DWORD)(100 - (avail * 100 / total));
+    return retval;
+}
+
+static BOOL WINAPI MyGetPhysicallyInstalledSystemMemory(PULONGLONG TotalMemoryInKilobytes)
+{
+    COUNT_CALL(GetPhysicallyInstalledSystemMemory);
+    BOOL retval = OrigGetPhysicallyInstalledSystemMemory(TotalMemoryInKilobytes);
+    if (retval && TotalMemoryInKilobytes)
+        *TotalMemoryInKilobytes = LimitTotalMemory(*TotalMemoryInKilobytes * 1024) / 1024;
+    return retval;
+}
+#endif
+
+// WMI answers Win32_Processor/Win32_ComputerSystem queries from the WMI service process, so the Kernel32 hooks never
+// see them. Instead, the COM objects that hand the results back to us are intercepted in-process: CoCreateInstance of
+// the WbemLocator leads to IWbemLocator::ConnectServer, which leads to IWbemServices::ExecQuery/CreateInstanceEnum,
+// which leads to IEnumWbemClassObject::Next, which leads to IWbemClassObject::Get where the processor counts are
+// rewritten. Each hop patches the vtable slot of the object it sees (rather than detouring the code behind it, which
+// for proxies can be a thunk shared with unrelated interfaces).
+
+#define MAX_VTABLE_PATCHES 32
+
+typedef struct VtablePatch
+{
+    void** slot;
+    void* orig;
+} VtablePatch;
+
+static SRWLOCK VtablePatchLock = SRWLOCK_INIT;
+static VtablePatch VtablePatches[MAX_VTABLE_PATCHES];
+static volatile LONG VtablePatchCount;
+
+#define VTABLE_INDEX(vtbl, method) (offsetof(vtbl, method) / sizeof(void*))
+
+// Finds the original function for a patched vtable slot. Lock-free: entries are only appended and are complete before
+// VtablePatchCount is incremented.
+static void* FindVtableOrig(void* iface, size_t index)
+{
+    void** slot = &(*(void***)iface)[index];
+    LONG count = VtablePatchCount;
+
+    for (LONG i = 0; i < count; ++i)
+    {
+        if (VtablePatches[i].slot == slot)
+            return VtablePatches[i].orig;
+    }
+    return NULL;
+}
+
+// Points the given slot of iface's vtable at detour, remembering the original. Objects sharing the vtable are covered
+// from then on; already-patched vtables are left alone.
+static void PatchVtable(void* iface, size_t index, void* detour)
+{
+    void** slot = &(*(void***)iface)[index];
+    DWORD oldProtect;
+
+    if (*slot == detour)
+        return;
+
+    AcquireSRWLockExclusive(&VtablePatchLock);
+    if (*slot != detour && VtablePatchCount < MAX_VTABLE_PATCHES)
+    {
+        if (VirtualProtect(slot, sizeof(void*), PAGE_READWRITE, &oldProtect))
+        {
+            VtablePatches[VtablePatchCount].slot = slot;
+            VtablePatches[VtablePatchCount].orig = *slot;
+            InterlockedIncrement(&VtablePatchCount);
+            InterlockedExchangePointer(slot, detour);
+            VirtualProtect(slot, sizeof(void*), oldProtect, &oldProtect);
+        }
+        else
+            Log("PatchVtable: VirtualProtect(%p) failed GLE=%u", slot, GetLastError());
+    }
+    ReleaseSRWLockExclusive(&VtablePatchLock);
+}
+
+static void RestoreVtables()
+{
+    DWORD oldProtect;
+
+    AcquireSRWLockExclusive(&VtablePatchLock);
+    for (LONG i = 0; i < VtablePatchCount; ++i)
+    {
+        void** slot = VtablePatches[i].slot;
+        if (VirtualProtect(slot, sizeof(void*), PAGE_READWRITE, &oldProtect))
+        {
+            InterlockedExchangePointer(slot, VtablePatches[i].orig);
+            VirtualProtect(slot, sizeof(void*), oldProtect, &oldProtect);
+        }
+    }
+    ReleaseSRWLockExclusive(&VtablePatchLock);
+}
+
+// Defined here so we don't need wbemuuid.lib
+static const CLSID kCLSID_WbemLocator = {
+    0x4590f811, 0x1d3a, 0x11d0, { 0x89, 0x1f, 0x00, 0xaa, 0x00, 0x4b, 0x2e, 0x24 }
+};
+static const IID kIID_IWbemLocator = { 0xdc12a687, 0x737f, 0x11cf, { 0x88, 0x4d, 0x00, 0xaa, 0x00, 0x4b, 0x2e, 0x24 } };
+
+// What the virtual counts reported through WMI are worked out from. Computed once on first use so that launchers
+// polling WMI stay cheap; jobserver tokens come and go, so the logical processor count is limited per query.
+static INIT_ONCE WmiValuesOnce = INIT_ONCE_STATIC_INIT;
+static DWORD WmiMachineProcessors;
+static LONG WmiCores; // 0 if unknown
+static LONG WmiPackages; // Win32_Processor instances, one per physical package
+
+static BOOL CALLBACK InitWmiValues(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    SYSTEM_INFO si;
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION buf;
+    DWORD length = 0;
+
+    // Not MyGetSystemInfo(), which would take jobserver tokens
+    OrigGetSystemInfo(&si);
+    WmiMachineProcessors = si.dwNumberOfProcessors;
+
+    // Each real core is reported REPORT_MULTIPLIER times, like the processors
+    WmiCores = (LONG)(GetLimitedCoreCount() * REPORT_MULTIPLIER);
+
+    // WMI enumerates every package on the machine, not just the ones we limit to
+    if (!QueryCPUInfo(NULL, &length) && GetLastError() == ERROR_INSUFFICIENT_BUFFER &&
+        (buf = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)HeapAlloc(GetProcessHeap(), 0, length)) != NULL)
+    {
+        if (QueryCPUInfo(buf, &length))
+        {
+            for (DWORD i = 0; i < length / sizeof(*buf); ++i)
+                WmiPackages += buf[i].Relationship == RelationProcessorPackage;
+        }
+        HeapFree(GetProcessHeap(), 0, buf);
+    }
+    WmiPackages = max(WmiPackages, 1);
+
+    Log("WMI virtual values: NumberOfLogicalProcessors=%u NumberOfCores=%d over %d packages",
+        ReportedCpuCount(WmiMachineProcessors), WmiCores, WmiPackages);
+    return TRUE;
+}
+
+typedef HRESULT(STDMETHODCALLTYPE* WbemGet_t)(IWbemClassObject*, LPCWSTR, long, VARIANT*, CIMTYPE*, long*);
+
+// Splits a machine-wide count across the Win32_Processor instances so that they add up to it. Instances are told apart
+// by DeviceID ("CPU0", "CPU1", ...); the earlier ones take the remainder.
+static LONG WmiPackageShare(IWbemClassObject* This, WbemGet_t get, LONG total)
+{
+    VARIANT id;
+    unsigned index;
+    LONG share = (total + WmiPackages - 1) / WmiPackages;
+
+    VariantInit(&id);
+    if (SUCCEEDED(get(This, L"DeviceID", 0, &id, NULL, NULL)) && V_VT(&id) == VT_BSTR &&
+        swscanf(V_BSTR(&id), L"CPU%u", &index) == 1)
+        share = total / WmiPackages + ((LONG)index < total % WmiPackages);
+    VariantClear(&id);
+    return share;
+}
+
+static HRESULT STDMETHODCALLTYPE MyWbemGet(
+    IWbemClassObject* This, LPCWSTR wszName, long lFlags, VARIANT* pVal, CIMTYPE* pType, long* plFlavor)
+{
+    WbemGet_t orig = (WbemGet_t)FindVtableOrig(This, VTABLE_INDEX(IWbemClassObjectVtbl, Get));
+    HRESULT hr;
+    bool logical, cores;
+    VARIANT cls;
+    LONG logicalCount, count;
+
+    if (!orig)
+        return E_UNEXPECTED;
+
+    hr = orig(This, wszName, lFlags, pVal, pType, plFlavor);
+    if (FAILED(hr) || !wszName || !pVal || V_VT(pVal) != VT_I4)
+        return hr;
+
+    logical = !_wcsicmp(wszName, L"NumberOfLogicalProcessors") || !_wcsicmp(wszName, L"ThreadCount");
+    cores = !_wcsicmp(wszName, L"NumberOfCores") || !_wcsicmp(wszName, L"NumberOfEnabledCore");
+    if (!logical && !cores)
+        return hr;
+
+    VariantInit(&cls);
+    if (SUCCEEDED(orig(This, L"__CLASS", 0, &cls, NULL, NULL)) && V_VT(&cls) == VT_BSTR)
+    {
+        InitOnceExecuteOnce(&WmiValuesOnce, InitWmiValues, NULL, NULL);
+        logicalCount = (LONG)ReportedCpuCount(WmiMachineProcessors);
+        count = logical || !WmiCores || WmiCores > logicalCount ? logicalCount : WmiCores;
+        if (!_wcsicmp(V_BSTR(&cls), L"Win32_Processor"))
+        {
+            // Per-package values: this package's share of the whole virtual machine, and never more than it has
+            count = WmiPackageShare(This, orig, count);
+            V_I4(pVal) = min(V_I4(pVal), count);
+        }
+        else if (!_wcsicmp(V_BSTR(&cls), L"Win32_ComputerSystem") && logical)
+        {
+            V_I4(pVal) = logicalCount;
+        }
+    }
+    VariantClear(&cls);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE
+MyWbemNext(IEnumWbemClassObject* This, long lTimeout, ULONG uCount, IWbemClassObject** apObjects, ULONG* puReturned)
+{
+    typedef HRESULT(STDMETHODCALLTYPE * Next_t)(IEnumWbemClassObject*, long, ULONG, IWbemClassObject**, ULONG*);
+    Next_t orig = (Next_t)FindVtableOrig(This, VTABLE_INDEX(IEnumWbemClassObjectVtbl, Next));
+    HRESULT hr;
+
+    if (!orig)
+        return E_UNEXPECTED;
+
+    hr = orig(This, lTimeout, uCount, apObjects, puReturned);
+    if (SUCCEEDED(hr) && apObjects && puReturned)
+    {
+        for (ULONG i = 0; i < *puReturned; ++i)
+        {
+            if (apObjects[i])
+                PatchVtable(apObjects[i], VTABLE_INDEX(IWbemClassObjectVtbl, Get), (void*)MyWbemGet);
+        }
+    }
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE MyWbemExecQuery(IWbemServices* This,
+                                                 const BSTR strQueryLanguage,
+                                                 const BSTR strQuery,
+                                                 long lFlags,
+                                                 IWbemContext* pCtx,
+                                                 IEnumWbemClassObject** ppEnum)
+{
+    typedef HRESULT(STDMETHODCALLTYPE * ExecQuery_t)(IWbemServices*, const BSTR, const BSTR, long, IWbemContext*,
+                                                     IEnumWbemClassObject**);
+    ExecQuery_t orig = (ExecQuery_t)FindVtableOrig(This, VTABLE_INDEX(IWbemServicesVtbl, ExecQuery));
+    HRESULT hr;
+
+    if (!orig)
+        return E_UNEXPECTED;
+
+    hr = orig(This, strQueryLanguage, strQuery, lFlags, pCtx, ppEnum);
+    if (SUCCEEDED(hr) && ppEnum && *ppEnum)
+        PatchVtable(*ppEnum, VTABLE_INDEX(IEnumWbemClassObjectVtbl, Next), (void*)MyWbemNext);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE MyWbemCreateInstanceEnum(
+    IWbemServices* This, const BSTR strFilter, long lFlags, IWbemContext* pCtx, IEnumWbemClassObject** ppEnum)
+{
+    typedef HRESULT(STDMETHODCALLTYPE * CreateInstanceEnum_t)(IWbemServices*, const BSTR, long, IWbemContext*,
+                                                              IEnumWbemClassObject**);
+    CreateInstanceEnum_t orig =
+        (CreateInstanceEnum_t)FindVtableOrig(This, VTABLE_INDEX(IWbemServicesVtbl, CreateInstanceEnum));
+    HRESULT hr;
+
+    if (!orig)
+        return E_UNEXPECTED;
+
+    hr = orig(This, strFilter, lFlags, pCtx, ppEnum);
+    if (SUCCEEDED(hr) && ppEnum && *ppEnum)
+        PatchVtable(*ppEnum, VTABLE_INDEX(IEnumWbemClassObjectVtbl, Next), (void*)MyWbemNext);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE MyWbemConnectServer(IWbemLocator* This,
+                                                     const BSTR strNetworkResource,
+                                                     const BSTR strUser,
+                                                     const BSTR strPassword,
+                                                     const BSTR strLocale,
+                                                     long lSecurityFlags,
+                                                     const BSTR strAuthority,
+                                                     IWbemContext* pCtx,
+                                                     IWbemServices** ppNamespace)
+{
+    typedef HRESULT(STDMETHODCALLTYPE * ConnectServer_t)(IWbemLocator*, const BSTR, const BSTR, const BSTR, const BSTR,
+                                                         long, const BSTR, IWbemContext*, IWbemServices**);
+    ConnectServer_t orig = (ConnectServer_t)FindVtableOrig(This, VTABLE_INDEX(IWbemLocatorVtbl, ConnectServer));
+    HRESULT hr;
+
+    if (!orig)
+        return E_UNEXPECTED;
+
+    hr = orig(This, strNetworkResource, strUser, strPassword, strLocale, lSecurityFlags, strAuthority, pCtx,
+              ppNamespace);
+    if (SUCCEEDED(hr) && ppNamespace && *ppNamespace)
+    {
+        PatchVtable(*ppNamespace, VTABLE_INDEX(IWbemServicesVtbl, ExecQuery), (void*)MyWbemExecQuery);
+        PatchVtable(
+            *ppNamespace, VTABLE_INDEX(IWbemServicesVtbl, CreateInstanceEnum), (void*)MyWbemCreateInstanceEnum);
+    }
+    return hr;
+}
+
+static HRESULT WINAPI
+MyCoCreateInstance(REFCLSID rclsid, LPUNKNOWN pUnkOuter, DWORD dwClsContext, REFIID riid, LPVOID* ppv)
+{
+    COUNT_CALL(CoCreateInstance);
+    HRESULT hr = OrigCoCreateInstance(rclsid, pUnkOuter, dwClsContext, riid, ppv);
+    if (SUCCEEDED(hr) && ppv && *ppv && IsEqualCLSID(rclsid, &kCLSID_WbemLocator))
+    {
+        // The caller may have asked for any interface; go through IWbemLocator to find the vtable to patch.
+        IUnknown* unk = (IUnknown*)*ppv;
+        IWbemLocator* locator;
+        if (SUCCEEDED(unk->lpVtbl->QueryInterface(unk, &kIID_IWbemLocator, (void**)&locator)))
+        {
+            Log("CoCreateInstance(WbemLocator) intercepted");
+            PatchVtable(locator, VTABLE_INDEX(IWbemLocatorVtbl, ConnectServer), (void*)MyWbemConnectServer);
+            locator->lpVtbl->Release(locator);
+        }
+    }
+    return hr;
+}
+
+// WMI is reached through COM, which many processes only load once they first use it. CoCreateInstance is hooked as soon
+// as combase (or, on older systems, ole32) is in the process: at attach if it already is, otherwise after whichever
+// LoadLibrary call brings it in.
+static volatile LONG ComHooked;
+
+static void HookCom()
+{
+    HMODULE hCombase;
+    LONG err;
+
+    if (ComHooked ||
+        (!(hCombase = GetModuleHandleW(L"combase.dll")) && !(hCombase = GetModuleHandleW(L"ole32.dll"))) ||
+        InterlockedExchange(&ComHooked, 1))
+        return;
+
+    if (!(OrigCoCreateInstance = (CoCreateInstance_t)GetProcAddress(hCombase, "CoCreateInstance")))
+    {
+        Log("Failed to find CoCreateInstance");
+        return;
+    }
+    if ((err = DetourTransactionBegin()) != NO_ERROR ||
+        (err = DetourAttach((PVOID*)&OrigCoCreateInstance, (void*)MyCoCreateInstance)) != NO_ERROR ||
+        (err = DetourTransactionCommit()) != NO_ERROR)
+    {
+        // Another transaction may have been in progress; try again on the next load
+        Log("HookCom: hooking CoCreateInstance failed: %d", err);
+        DetourTransactionAbort();
+        OrigCoCreateInstance = NULL;
+        InterlockedExchange(&ComHooked, 0);
+        return;
+    }
+    Log("COM loaded; WMI queries will be virtualized");
+}
+
+static HMODULE WINAPI MyLoadLibraryExW(LPCWSTR lpLibFileName, HANDLE hFile, DWORD dwFlags)
+{
+    HMODULE retval = OrigLoadLibraryExW(lpLibFileName, hFile, dwFlags);
+    DWORD error = GetLastError();
+
+    if (retval && !ComHooked)
+    {
+        HookCom();
+        SetLastError(error);
+    }
+    return retval;
+}
+
+#define NO_CPU ((DWORD)-1)
+
+// Per-thread bookkeeping. Every thread that attaches gets one of these, reachable through TLS from the thread itself
+// and through ThreadList from everyone else (ThreadListLock must be held to walk the list).
+typedef struct ThreadState
+{
+    struct ThreadState* prev;
+    struct ThreadState* next;
+    HANDLE hThread; // Real handle (duplicated), owned by the ThreadState
+    DWORD threadId;
+    DWORD_PTR affinity; // Affinity applied at placement time
+    ULONG64 startCycles;
+    LARGE_INTEGER startTime;
+    FrameDetector frames; // Only written by the thread itself
+
+    ULONG64 missedDeadlines;     // Only written by the thread itself
+    ULONG64 hookCycles;          // Estimated from sampled waits. Only written by the thread itself
+    unsigned waits;              // Hooked waits begun. Only written by the thread itself
+    ULONG64 migrations;          // Only written by the thread itself
+    DWORD lastCpu;               // NO_CPU until the first wake-up. Only written by the thread itself
+    DWORD cpuHits[64];           // Wake-ups per processor, halved now and then. Only written by the thread itself
+    volatile LONGLONG waitStart; // QPC when the current hooked wait began, or 0. Only written by the thread itself
+    LONGLONG waitTicks;          // Total time blocked in hooked waits. Only written by the thread itself
+#if METRICS
+    ULONG64 hookCalls[CountedHooks]; // Only written by the thread itself
+#endif
+
+    // Only written by the service thread
+    const ThreadRule* rule;
+    bool startModuleKnown;
+    WCHAR startModule[64];
+#if POOL_EFFICIENCY
+    WCHAR startSymbol[STATS_LABEL_LENGTH]; // "module!export" or "module+0xoffset", or empty if unknown
+#endif
+    int savedPriority;
+    volatile LONGLONG deadlineTicks; // 0 when the thread has no deadline
+    ULONG64 reportedMissed;
+    ULONG64 reportedHookCycles;
+    ULONG64 lastCpuTime; // 100ns units, as of the last stats update
+    ULONG64 reportedMigrations;
+    unsigned migrationRate; // Per second, over the last housekeeping interval
+    bool pinned;
+    unsigned pinnedCpu;
+    unsigned pinnedPasses; // Housekeeping passes left before the pin is lifted
+    DWORD_PTR affinityBeforePin;
+    bool poolSampled;
+    ULONG64 poolCpuTime; // 100ns units, as of the last pool sample
+    LONGLONG poolWaitTicks;
+} ThreadState;
+
+static DWORD ThreadStateTls = TLS_OUT_OF_INDEXES;
+static LARGE_INTEGER QpcFrequency;
+static SRWLOCK ThreadListLock = SRWLOCK_INIT;
+static ThreadState* ThreadList;
+#if MIGRATION_DAMPING
+static volatile LONG PinnedPerCpu[64]; // Threads pinned to each processor by migration damping
+#endif
+#if METRICS
+static ULONG64 ExitedHookCalls[CountedHooks]; // Calls made by threads that have exited. ThreadListLock protects it.
+
+static void CountCall(int hook)
+{
+    ThreadState* ts;
+
+    if (ThreadStateTls != TLS_OUT_OF_INDEXES && (ts = (ThreadState*)TlsGetValue(ThreadStateTls)) != NULL)
+        ++ts->hookCalls[hook];
+    else
+        InterlockedIncrement64(&HookCalls[hook].calls);
+}
+#endif
+
+// ThreadListLock must be held exclusively for these
+static void LinkThreadState(ThreadState* ts)
+{
+    ts->prev = NULL;
+    ts->next = ThreadList;
+    if (ThreadList)
+        ThreadList->prev = ts;
+    ThreadList = ts;
+}
+
+static void UnlinkThreadState(ThreadState* ts)
+{
+    if (ts->prev)
+        ts->prev->next = ts->next;
+    else
+        ThreadList = ts->next;
+    if (ts->next)
+        ts->next->prev = ts->prev;
+    ts->prev = ts->next = NULL;
+}
+
+// Restricts the given thread to EnforcedMask and records the result. ThreadListLock must be held exclusively, so that
+// the tick controller can't resize the set in between.
+static void PlaceThread(ThreadState* ts)
+{
+#if ENFORCE_AFFINITY
+    if (!EnforcedMask || !OrigSetThreadAffinityMask)
+        return;
+
+    if (OrigSetThreadAffinityMask(ts->hThread, EnforcedMask))
+        ts->affinity = EnforcedMask;
+    else
+        Log("PlaceThread: SetThreadAffinityMask(%u, %zx) failed GLE=%u", ts->threadId, EnforcedMask, GetLastError());
+#endif
+}
+
+// Creates the bookkeeping for a thread, places it and adds it to ThreadList. hThread is consumed.
+static ThreadState* AttachThread(HANDLE hThread, DWORD threadId)
+{
+    ThreadState* ts = (ThreadState*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ThreadState));
+    if (!ts)
+    {
+        CloseHandle(hThread);
+        return NULL;
+    }
+
+    ts->hThread = hThread;
+    ts->threadId = threadId;
+    QueryThreadCycleTime(hThread, &ts->startCycles);
+    QueryPerformanceCounter(&ts->startTime);
+    FrameDetector_Init(&ts->frames, (uint64_t)QpcFrequency.QuadPart);
+    ts->lastCpu = NO_CPU;
+
+    AcquireSRWLockExclusive(&ThreadListLock);
+    PlaceThread(ts);
+    LinkThreadState(ts);
+    ReleaseSRWLockExclusive(&ThreadListLock);
+    return ts;
+}
+
+// Called on DLL_THREAD_ATTACH (and for the thread that loads us) to set up the calling thread.
+static void AttachCurrentThread()
+{
+    HANDLE hThread;
+    ThreadState* ts;
+
+    if (ThreadStateTls == TLS_OUT_OF_INDEXES || TlsGetValue(ThreadStateTls))
+        return;
+
+    // A thread that was starting up while AttachExistingThreads() ran may already have bookkeeping; adopt it.
+    AcquireSRWLockShared(&ThreadListLock);
+    for (ts = ThreadList; ts && ts->threadId != GetCurrentThreadId(); ts = ts->next)
+        ;
+    ReleaseSRWLockShared(&ThreadListLock);
+    if (ts)
+    {
+        TlsSetValue(ThreadStateTls, ts);
+        return;
+    }
+
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &hThread, 0, FALSE,
+                         DUPLICATE_SAME_ACCESS))
+    {
+        Log("AttachCurrentThread: DuplicateHandle failed GLE=%u", GetLastError());
+        return;
+    }
+
+    if ((ts = AttachThread(hThread, GetCurrentThreadId())) != NULL)
+        TlsSetValue(ThreadStateTls, ts);
+}
+
+// Threads that were running before we were loaded never see DLL_THREAD_ATTACH, so find them and bring them under the
+// placement policy too. They only get TLS-less bookkeeping since we can't set TLS for another thread.
+static void AttachExistingThreads()
+{
+    THREADENTRY32 te = { sizeof(te) };
+    DWORD pid = GetCurrentProcessId(), tid = GetCurrentThreadId();
+    HANDLE hSnap = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+
+    if (hSnap == INVALID_HANDLE_VALUE)
+    {
+        Log("AttachExistingThreads: CreateToolhelp32Snapshot failed GLE=%u", GetLastError());
+        return;
+    }
+
+    for (BOOL ok = Thread32First(hSnap, &te); ok; ok = Thread32Next(hSnap, &te))
+    {
+        HANDLE hThread;
+
+        if (te.th32OwnerProcessID != pid || te.th32ThreadID == tid)
+            continue;
+
+        hThread = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION | THREAD_SUSPEND_RESUME, FALSE,
+                             te.th32ThreadID);
+        if (!hThread)
+        {
+            Log("AttachExistingThreads: OpenThread(%u) failed GLE=%u", te.th32ThreadID, GetLastError());
+            continue;
+        }
+        AttachThread(hThread, te.th32ThreadID);
+    }
+    CloseHandle(hSnap);
+}
+
+// Finalizes the stats for a thread and releases its bookkeeping. Caller must have removed it from ThreadList.
+static void FreeThreadState(ThreadState* ts)
+{
+#if LOGGING
+    ULONG64 cycles = 0;
+    LARGE_INTEGER now;
+
+    QueryThreadCycleTime(ts->hThread, &cycles);
+    QueryPerformanceCounter(&now);
+    Log("Thread %u finished: %llu cycles over %.3f ms (affinity %zx)", ts->threadId, cycles - ts->startCycles,
+        (double)(now.QuadPart - ts->startTime.QuadPart) * 1000.0 / (double)QpcFrequency.QuadPart, ts->affinity);
+    if (ts->frames.frames)
+    {
+        FrameStats stats;
+        FrameDetector_GetStats(&ts->frames, &stats);
+        Log("Thread %u frames: %llu avg=%.3f ms jitter=%.3f ms locked=%s", ts->threadId, stats.frames, stats.avgMs,
+            stats.jitterMs, boolstr(stats.locked));
+    }
+#endif
+
+#if MIGRATION_DAMPING
+    if (ts->pinned)
+        InterlockedDecrement(&PinnedPerCpu[ts->pinnedCpu]);
+#endif
+
+    CloseHandle(ts->hThread);
+    HeapFree(GetProcessHeap(), 0, ts);
+}
+
+// Called on DLL_THREAD_DETACH
+static void DetachCurrentThread()
+{
+    ThreadState* ts = NULL;
+
+    if (ThreadStateTls == TLS_OUT_OF_INDEXES)
+        return;
+
+    AcquireSRWLockExclusive(&ThreadListLock);
+    if ((ts = (ThreadState*)TlsGetValue(ThreadStateTls)) == NULL)
+    {
+        // Threads picked up by AttachExistingThreads() have no TLS; find them by ID.
+        DWORD tid = GetCurrentThreadId();
+        for (ts = ThreadList; ts && ts->threadId != tid; ts = ts->next)
+            ;
+    }
+    if (ts)
+    {
+        UnlinkThreadState(ts);
+#if METRICS
+        for (int i = 0; i < CountedHooks; ++i)
+            ExitedHookCalls[i] += ts->hookCalls[i];
+#endif
+    }
+    ReleaseSRWLockExclusive(&ThreadListLock);
+
+    if (ts)
+    {
+        TlsSetValue(ThreadStateTls, NULL);
+        FreeThreadState(ts);
+    }
+}
+
+// Releases all remaining bookkeeping (process detach).
+static void FreeAllThreadStates()
+{
+    AcquireSRWLockExclusive(&ThreadListLock);
+    while (ThreadList)
+    {
+        ThreadState* ts = ThreadList;
+        UnlinkThreadState(ts);
+        FreeThreadState(ts);
+    }
+    ReleaseSRWLockExclusive(&ThreadListLock);
+
+    if (ThreadStateTls != TLS_OUT_OF_INDEXES)
+    {
+        TlsFree(ThreadStateTls);
+        ThreadStateTls = TLS_OUT_OF_INDEXES;
+    }
+}
+
+// Reports the frame cadence of the process: that of the thread with a stable cadence that has seen the most frames
+// (normally the main or render thread). Returns false if no thread has locked onto a cadence yet.
+static bool GetProcessFrameStats(FrameStats* stats)
+{
+    const ThreadState* best = NULL;
+
+    AcquireSRWLockShared(&ThreadListLock);
+    for (const ThreadState* ts = ThreadList; ts; ts = ts->next)
+    {
+        if (FrameDetector_IsLocked(&ts->frames) && (!best || ts->frames.frames > best->frames.frames))
+            best = ts;
+    }
+    if (best)
+        FrameDetector_GetStats(&best->frames, stats);
+    ReleaseSRWLockShared(&ThreadListLock);
+    return best != NULL;
+}
+
+#if TICK_TARGET_MS
+// Busy time (ms) of each tick of the thread the tick controller watches, handed to the service thread. The interval
+// between boundaries is just the tick period for a server that keeps up, so the wait at the boundary is left out.
+#    define TICK_RING 1024
+static ThreadState* volatile TickThread;
+static float TickRing[TICK_RING];
+static volatile LONG TickHead;
+#endif
+
+#if WORK_STEALING_POOL
+// Only QueueUserWorkItem is routed here. TrySubmitThreadpoolCallback and SubmitThreadpoolWork callbacks receive a
+// PTP_CALLBACK_INSTANCE (and PTP_WORK objects can be waited on and cancelled) which only the OS pool can provide.
+#    define POOL_DEQUE_CAPACITY 4096
+
+typedef struct PoolTask
+{
+    struct PoolTask* next; // Only used while in the injection queue
+    LPTHREAD_START_ROUTINE fn;
+    PVOID context;
+} PoolTask;
+
+typedef struct PoolWorker
+{
+    WsDeque deque;
+    unsigned cpu;
+    unsigned* stealOrder; // PoolWorkerCount - 1 entries
+    bool inTask;
+    bool blocked; // In a wait (other than a poll) inside a task
+    unsigned waitDepth; // Hooked waits can nest
+} PoolWorker;
+
+static INIT_ONCE PoolOnce = INIT_ONCE_STATIC_INIT;
+static PoolWorker* PoolWorkers;
+static unsigned PoolWorkerCount;
+static DWORD PoolWorkerTls = TLS_OUT_OF_INDEXES;
+// Semaphore released once per submitted task. Tasks that a running worker takes without waiting leave their release
+// behind, so there are never fewer releases than queued tasks; the extras just cost a worker a wasted wake-up.
+static HANDLE PoolWakeup;
+static volatile LONG PoolStarted; // Workers whose thread is running
+static volatile LONG PoolBlocked;
+
+// Tasks submitted from outside the pool (or when a worker's deque is full) go here in FIFO order
+static SRWLOCK PoolInjectLock = SRWLOCK_INIT;
+static PoolTask* volatile PoolInjectHead;
+static PoolTask* PoolInjectTail;
+
+static PoolTask* TakeInjectedTask()
+{
+    PoolTask* task;
+
+    if (!PoolInjectHead)
+        return NULL;
+
+    AcquireSRWLockExclusive(&PoolInjectLock);
+    if ((task = PoolInjectHead) != NULL && (PoolInjectHead = task->next) == NULL)
+        PoolInjectTail = NULL;
+    ReleaseSRWLockExclusive(&PoolInjectLock);
+    return task;
+}
+
+// Returns NULL only once every deque and the injection queue have been seen empty. A lost steal doesn't count as
+// empty: the worker would go back to sleep with a task still queued and that task's wake-up already used.
+static PoolTask* FindPoolTask(PoolWorker* w)
+{
+    PoolTask* task;
+    bool contended;
+
+    if ((task = (PoolTask*)WsDeque_Pop(&w->deque)) != NULL || (task = TakeInjectedTask()) != NULL)
+        return task;
+
+    do
+    {
+        contended = false;
+        for (unsigned i = 0; i + 1 < PoolWorkerCount; ++i)
+        {
+            WsStealResult result = WsDeque_Steal(&PoolWorkers[w->stealOrder[i]].deque, (void**)&task);
+            if (result == WsStealSuccess)
+                return task;
+            contended = contended || result == WsStealAbort;
+        }
+        // Tasks may have been injected while we were stealing
+        if ((task = TakeInjectedTask()) != NULL)
+            return task;
+    } while (contended);
+    return NULL;
+}
+
+static void PushInjectedTask(PoolTask* task)
+{
+    task->next = NULL;
+    AcquireSRWLockExclusive(&PoolInjectLock);
+    if (PoolInjectTail)
+        PoolInjectTail->next = task;
+    else
+        PoolInjectHead = task;
+    PoolInjectTail = task;
+    ReleaseSRWLockExclusive(&PoolInjectLock);
+}
+
+static DWORD WINAPI RunPoolTaskOnOsPool(LPVOID param)
+{
+    PoolTask* task = (PoolTask*)param;
+
+    task->fn(task->context);
+    HeapFree(GetProcessHeap(), 0, task);
+    return 0;
+}
+
+// Hands every queued task to the OS pool. Called when all workers are blocked inside tasks, which may well be waiting
+// for the very tasks queued behind them.
+static void DrainPoolTasks()
+{
+    PoolTask* task;
+    unsigned moved = 0;
+
+    for (unsigned w = 0; w < PoolWorkerCount; ++w)
+    {
+        WsStealResult result;
+        while ((result = WsDeque_Steal(&PoolWorkers[w].deque, (void**)&task)) != WsStealEmpty)
+        {
+            if (result == WsStealSuccess)
+                PushInjectedTask(task);
+        }
+    }
+    while ((task = TakeInjectedTask()) != NULL)
+    {
+        if (!OrigQueueUserWorkItem(RunPoolTaskOnOsPool, task, WT_EXECUTEDEFAULT))
+        {
+            Log("DrainPoolTasks: QueueUserWorkItem failed GLE=%u", GetLastError());
+            PushInjectedTask(task);
+            break;
+        }
+        ++moved;
+    }
+    if (moved)
+        Log("DrainPoolTasks: all %ld workers blocked; moved %u tasks to the OS pool", PoolStarted, moved);
+}
+
+// Called by the wait hooks around every wait, polls included (they just don't count as blocking)
+static void PoolWaitBegin(DWORD dwMilliseconds)
+{
+    PoolWorker* w;
+
+    if (PoolWorkerTls == TLS_OUT_OF_INDEXES || !(w = (PoolWorker*)TlsGetValue(PoolWorkerTls)))
+        return;
+    if (w->waitDepth++ == 0 && w->inTask && dwMilliseconds)
+    {
+        w->blocked = true;
+        if (InterlockedIncrement(&PoolBlocked) >= PoolStarted)
+            DrainPoolTasks();
+    }
+}
+
+static void PoolWaitEnd()
+{
+    PoolWorker* w;
+
+    if (PoolWorkerTls == TLS_OUT_OF_INDEXES || !(w = (PoolWorker*)TlsGetValue(PoolWorkerTls)) || !w->waitDepth)
+        return;
+    if (--w->waitDepth == 0 && w->blocked)
+    {
+        w->blocked = false;
+        InterlockedDecrement(&PoolBlocked);
+    }
+}
+
+static DWORD WINAPI PoolWorkerProc(LPVOID param)
+{
+    PoolWorker* w = (PoolWorker*)param;
+
+    TlsSetValue(PoolWorkerTls, w);
+    if (OrigSetThreadAffinityMask)
+        OrigSetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << w->cpu);
+    InterlockedIncrement(&PoolStarted);
+
+    for (;;)
+    {
+        PoolTask* task = FindPoolTask(w);
+        if (!task)
+        {
+            WaitForSingleObject(PoolWakeup, INFINITE);
+            continue;
+        }
+        w->inTask = true;
+        task->fn(task->context);
+        w->inTask = false;
+        HeapFree(GetProcessHeap(), 0, task);
+    }
+}
+
+static BOOL CALLBACK InitPool(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    unsigned domains[64], cpus[64], count = 0;
+
+    for (unsigned cpu = 0; cpu < 64; ++cpu)
+    {
+        if (EnforcedMask & ((DWORD_PTR)1 << cpu))
+        {
+            domains[count] = 0;
+            cpus[count++] = cpu;
+        }
+    }
+
+    // L3 domains from the (filtered) cache topology; CPUs without one share domain 0
+    if (CachedCPUInfo || CacheCPUInfo())
+    {
+        unsigned domain = 0;
+        for (DWORD i = 0; i < CachedCPUInfoCount; ++i)
+        {
+            if (CachedCPUInfo[i].Relationship != RelationCache || CachedCPUInfo[i].Cache.Level != 3)
+                continue;
+            ++domain;
+            for (unsigned w = 0; w < count; ++w)
+            {
+                if (CachedCPUInfo[i].ProcessorMask & ((ULONG_PTR)1 << cpus[w]))
+                    domains[w] = domain;
+            }
+        }
+    }
+
+    if (!count || (PoolWorkerTls = TlsAlloc()) == TLS_OUT_OF_INDEXES ||
+        !(PoolWakeup = CreateSemaphoreW(NULL, 0, LONG_MAX, NULL)) ||
+        !(PoolWorkers = (PoolWorker*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count * sizeof(PoolWorker))))
+    {
+        Log("InitPool: failed to set up %u workers GLE=%u", count, GetLastError());
+        return TRUE;
+    }
+
+    for (unsigned w = 0; w < count; ++w)
+    {
+        PoolWorker* worker = &PoolWorkers[w];
+        worker->cpu = cpus[w];
+        worker->stealOrder = (unsigned*)HeapAlloc(GetProcessHeap(), 0, count * sizeof(unsigned));
+        if (!worker->stealOrder || !WsDeque_Init(&worker->deque, POOL_DEQUE_CAPACITY))
+        {
+            Log("InitPool: out of memory");
+            return TRUE;
+        }
+        WsBuildStealOrder(domains, count, w, worker->stealOrder);
+    }
+
+    // Only publish the workers once they're all set up; threads that fail to start simply don't take work
+    PoolWorkerCount = count;
+    for (unsigned w = 0; w < count; ++w)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, PoolWorkerProc, &PoolWorkers[w], 0, NULL);
+        if (hThread)
+            CloseHandle(hThread);
+        else
+            Log("InitPool: CreateThread failed GLE=%u", GetLastError());
+    }
+    Log("InitPool: %u workers", count);
+    return TRUE;
+}
+
+static bool SubmitPoolTask(LPTHREAD_START_ROUTINE fn, PVOID context)
+{
+    PoolWorker* w;
+    PoolTask* task;
+
+    if (!InitOnceExecuteOnce(&PoolOnce, InitPool, NULL, NULL) || !PoolWorkerCount)
+        return false;
+    // With every worker blocked, nothing here would run until one of them wakes up
+    if (PoolBlocked >= PoolStarted)
+        return false;
+    if (!(task = (PoolTask*)HeapAlloc(GetProcessHeap(), 0, sizeof(PoolTask))))
+        return false;
+    task->next = NULL;
+    task->fn = fn;
+    task->context = context;
+
+    // Workers push to their own deque (LIFO, cache-warm); everyone else goes through the injection queue
+    w = (PoolWorker*)TlsGetValue(PoolWorkerTls);
+    if (!w || !WsDeque_Push(&w->deque, task))
+        PushInjectedTask(task);
+    ReleaseSemaphore(PoolWakeup, 1, NULL);
+    // The last worker may have blocked (and drained the queues) while the task was going in
+    if (PoolBlocked >= PoolStarted)
+        DrainPoolTasks();
+    return true;
+}
+
+static BOOL WINAPI MyQueueUserWorkItem(LPTHREAD_START_ROUTINE Function, PVOID Context, ULONG Flags)
+{
+    static bool called;
+
+    COUNT_CALL(QueueUserWorkItem);
+    if (!called)
+    {
+        called = true;
+        Log("QueueUserWorkItem called at least once, first: (%p, %p, %x)", Function, Context, Flags);
+    }
+
+    // The high word only carries a thread limit hint. Anything else (WT_EXECUTELONGFUNCTION, I/O threads,
+    // impersonation) stays with the OS pool, which can add threads for callbacks that run long or block.
+    if ((Flags & 0xFFFF) == WT_EXECUTEDEFAULT && Function && SubmitPoolTask(Function, Context))
+        return TRUE;
+    return OrigQueueUserWorkItem(Function, Context, Flags);
+}
+#endif
+
+#if FRAME_DETECTION
+// Wait hooks feeding the calling thread's FrameDetector. Zero-timeout waits are polls and are passed straight through.
+static ThreadState* BeginWait(DWORD dwMilliseconds)
+{
+    ThreadState* ts;
+    LARGE_INTEGER now;
+#if OVERHEAD_BUDGET_PERMILLE
+    unsigned long long start = 0;
+#endif
+
+#if WORK_STEALING_POOL
+    PoolWaitBegin(dwMilliseconds);
+#endif
+    if (!dwMilliseconds || ThreadStateTls == TLS_OUT_OF_INDEXES || IsFeatureDisabled(FeatureFrames))
+        return NULL;
+    if ((ts = (ThreadState*)TlsGetValue(ThreadStateTls)) != NULL)
+    {
+#if OVERHEAD_BUDGET_PERMILLE
+        // One wait in OVERHEAD_SAMPLE_WAITS is timed and stands for all of them; EndWait times the same one
+        if (++ts->waits % OVERHEAD_SAMPLE_WAITS == 0)
+            start = __rdtsc();
+#endif
+        QueryPerformanceCounter(&now);
+        FrameDetector_WaitBegin(&ts->frames, (uint64_t)now.QuadPart);
+#if POOL_EFFICIENCY
+        ts->waitStart = now.QuadPart;
+#endif
+#if OVERHEAD_BUDGET_PERMILLE
+        if (start)
+            ts->hookCycles += (__rdtsc() - start) * OVERHEAD_SAMPLE_WAITS;
+#endif
+    }
+    return ts;
+}
+
+static void EndWait(ThreadState* ts)
+{
+    LARGE_INTEGER now;
+#if MIGRATION_DAMPING
+    DWORD cpu;
+#endif
+
+#if OVERHEAD_BUDGET_PERMILLE
+    unsigned long long start = 0;
+#endif
+
+#if WORK_STEALING_POOL
+    PoolWaitEnd();
+#endif
+    if (!ts)
+        return;
+#if OVERHEAD_BUDGET_PERMILLE
+    if (ts->waits % OVERHEAD_SAMPLE_WAITS == 0)
+        start = __rdtsc();
+#endif
+#if MIGRATION_DAMPING
+    if ((cpu = GetCurrentProcessorNumber()) < _countof(ts->cpuHits))
+    {
+        // The first wake-up has nothing to compare to
+        if (cpu != ts->lastCpu && ts->lastCpu != NO_CPU)
+            ++ts->migrations;
+        ts->lastCpu = cpu;
+        // Decay, so that the most-used processor reflects recent behavior
+        if (++ts->cpuHits[cpu] >= 1024)
+        {
+            for (unsigned i = 0; i < _countof(ts->cpuHits); ++i)
+                ts->cpuHits[i] >>= 1;
+        }
+    }
+#endif
+    QueryPerformanceCounter(&now);
+#if POOL_EFFICIENCY
+    if (ts->waitStart)
+    {
+        // Cleared first: the service thread may briefly undercount, but never counts a wait twice
+        LONGLONG start = ts->waitStart;
+        ts->waitStart = 0;
+        ts->waitTicks += now.QuadPart - start;
+    }
+#endif
+    if (FrameDetector_WaitEnd(&ts->frames, (uint64_t)now.QuadPart))
+    {
+        if (ts->deadlineTicks && ts->frames.lastFrame > (uint64_t)ts->deadlineTicks)
+            ++ts->missedDeadlines;
+#if TICK_TARGET_MS
+        if (ts == TickThread)
+        {
+            TickRing[(ULONG)TickHead % TICK_RING] = (float)(ts->frames.lastBusy * 1000.0 / QpcFrequency.QuadPart);
+            InterlockedIncrement(&TickHead);
+        }
+#endif
+    }
+#if OVERHEAD_BUDGET_PERMILLE
+    if (start)
+        ts->hookCycles += (__rdtsc() - start) * OVERHEAD_SAMPLE_WAITS;
+#endif
+}
+
+static void WINAPI MySleep(DWORD dwMilliseconds)
+{
+    COUNT_CALL(Sleep);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    OrigSleep(dwMilliseconds);
+    EndWait(ts);
+}
+
+static DWORD WINAPI MySleepEx(DWORD dwMilliseconds, BOOL bAlertable)
+{
+    COUNT_CALL(SleepEx);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    DWORD retval = OrigSleepEx(dwMilliseconds, bAlertable);
+    EndWait(ts);
+    return retval;
+}
+
+static DWORD WINAPI MyWaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+    COUNT_CALL(WaitForSingleObject);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    DWORD retval = OrigWaitForSingleObject(hHandle, dwMilliseconds);
+    EndWait(ts);
+    return retval;
+}
+
+static DWORD WINAPI MyWaitForSingleObjectEx(HANDLE hHandle, DWORD dwMilliseconds, BOOL bAlertable)
+{
+    COUNT_CALL(WaitForSingleObjectEx);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    DWORD retval = OrigWaitForSingleObjectEx(hHandle, dwMilliseconds, bAlertable);
+    EndWait(ts);
+    return retval;
+}
+
+static DWORD WINAPI MyWaitForMultipleObjects(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, DWORD dwMilliseconds)
+{
+    COUNT_CALL(WaitForMultipleObjects);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    DWORD retval = OrigWaitForMultipleObjects(nCount, lpHandles, bWaitAll, dwMilliseconds);
+    EndWait(ts);
+    return retval;
+}
+
+static DWORD WINAPI MyWaitForMultipleObjectsEx(
+    DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, DWORD dwMilliseconds, BOOL bAlertable)
+{
+    COUNT_CALL(WaitForMultipleObjectsEx);
+    ThreadState* ts = BeginWait(dwMilliseconds);
+    DWORD retval = OrigWaitForMultipleObjectsEx(nCount, lpHandles, bWaitAll, dwMilliseconds, bAlertable);
+    EndWait(ts);
+    return retval;
+}
+#endif
+
+// Case-insensitive match supporting * and ?
+static bool WildcardMatch(const WCHAR* pattern, const WCHAR* str)
+{
+    const WCHAR *star = NULL, *retry = NULL;
+
+    while (*str)
+    {
+        if (*pattern == L'*')
+        {
+            star = ++pattern;
+            retry = str;
+        }
+        else if (*pattern == L'?' || towlower(*pattern) == towlower(*str))
+        {
+            ++pattern;
+            ++str;
+        }
+        else if (star)
+        {
+            pattern = star;
+            str = ++retry;
+        }
+        else
+            return false;
+    }
+    while (*pattern == L'*')
+        ++pattern;
+    return !*pattern;
+}
+
+static GetThreadDescription_t pGetThreadDescription;
+static NtQueryInformationThread_t pNtQueryInformationThread;
+static SetThreadInformation_t pSetThreadInformation; // Windows 8+
+
+#if POOL_EFFICIENCY
+// Names a thread's start address after the export it is, or else its offset in the module, so that threads that start
+// in the same module at different places (ntdll's thread pool workers and its other threads, say) are told apart. The
+// headers are read straight from the mapped image; the module may be unloaded meanwhile, hence the __try.
+static void NameStartAddress(ThreadState* ts, PVOID start)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    const BYTE* base;
+    WCHAR suffix[16];
+    DWORD rva;
+
+    if (!VirtualQuery(start, &mbi, sizeof(mbi)) || mbi.Type != MEM_IMAGE || !(base = (const BYTE*)mbi.AllocationBase))
+        return;
+    rva = (DWORD)((const BYTE*)start - base);
+
+    __try
+    {
+        const IMAGE_DOS_HEADER* dos = (const IMAGE_DOS_HEADER*)base;
+        const IMAGE_NT_HEADERS* nt = (const IMAGE_NT_HEADERS*)(base + dos->e_lfanew);
+        const IMAGE_DATA_DIRECTORY* dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+        if (dos->e_magic == IMAGE_DOS_SIGNATURE && nt->Signature == IMAGE_NT_SIGNATURE && dir->VirtualAddress)
+        {
+            const IMAGE_EXPORT_DIRECTORY* exports = (const IMAGE_EXPORT_DIRECTORY*)(base + dir->VirtualAddress);
+            const DWORD* functions = (const DWORD*)(base + exports->AddressOfFunctions);
+            const DWORD* names = (const DWORD*)(base + exports->AddressOfNames);
+            const WORD* ordinals = (const WORD*)(base + exports->AddressOfNameOrdinals);
+
+            for (DWORD i = 0; i < exports->NumberOfNames; ++i)
+            {
+                if (ordinals[i] < exports->NumberOfFunctions && functions[ordinals[i]] == rva)
+                {
+                    WCHAR text[MAX_PATH];
+                    swprintf_s(text, _countof(text), L"%ls!%.200hs", ts->startModule, (const char*)(base + names[i]));
+                    wcsncpy_s(ts->startSymbol, _countof(ts->startSymbol), text, _TRUNCATE);
+                    return;
+                }
+            }
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return;
+    }
+
+    // The offset is what tells the pools apart, so a long module name gives way
+    swprintf_s(suffix, _countof(suffix), L"+0x%x", rva);
+    swprintf_s(ts->startSymbol, _countof(ts->startSymbol), L"%.*ls%ls",
+               (int)(_countof(ts->startSymbol) - wcslen(suffix) - 1), ts->startModule, suffix);
+}
+#endif
+
+// Finds the file name of the module that a thread started in. Uses the memory manager rather than the loader so that
+// it doesn't need the loader lock (which a thread in DLL_THREAD_ATTACH may hold while waiting on ThreadListLock).
+static void ResolveStartModule(ThreadState* ts)
+{
+    const ULONG ThreadQuerySetWin32StartAddress = 9;
+    PVOID start = NULL;
+    WCHAR path[MAX_PATH];
+    const WCHAR* base;
+    DWORD len;
+
+    ts->startModuleKnown = true;
+    if (!pNtQueryInformationThread ||
+        pNtQueryInformationThread(ts->hThread, ThreadQuerySetWin32StartAddress, &start, sizeof(start), NULL) < 0 ||
+        !(len = K32GetMappedFileNameW(GetCurrentProcess(), start, path, _countof(path))))
+        return;
+
+    base = wcsrchr(path, L'\\');
+    base = base ? base + 1 : path;
+    wcsncpy_s(ts->startModule, _countof(ts->startModule), base, _TRUNCATE);
+#if POOL_EFFICIENCY
+    NameStartAddress(ts, start);
+#endif
+}
+
+// Sets a thread's power throttling: EcoQoS when `throttle`, high QoS when not, or back to the system's choice when
+// `control` is false.
+static void SetThreadQos(ThreadState* ts, bool control, bool throttle)
+{
+    THREAD_POWER_THROTTLING_STATE state = { THREAD_POWER_THROTTLING_CURRENT_VERSION };
+
+    state.ControlMask = control ? THREAD_POWER_THROTTLING_EXECUTION_SPEED : 0;
+    state.StateMask = control && throttle ? THREAD_POWER_THROTTLING_EXECUTION_SPEED : 0;
+    if (pSetThreadInformation && !pSetThreadInformation(ts->hThread, ThreadPowerThrottling, &state, sizeof(state)))
+        Log("SetThreadQos: failed for thread %u GLE=%u", ts->threadId, GetLastError());
+}
+
+// Returns the thread's current group 0 affinity mask, or 0 if it can't be read or the thread is in another group
+static DWORD_PTR GetThreadMask(HANDLE hThread)
+{
+    GROUP_AFFINITY affinity;
+
+    if (!OrigGetThreadGroupAffinity || !OrigGetThreadGroupAffinity(hThread, &affinity) || affinity.Group != 0)
+        return 0;
+    return affinity.Mask;
+}
+
+// Moves a thread into (or, with 0, back out of) a partition of the enforced set
+static void SetThreadPartition(ThreadState* ts, DWORD_PTR mask)
+{
+    DWORD_PTR affinity = (mask & EnforcedMask) ? (mask & EnforcedMask) : EnforcedMask;
+
+    if (!affinity || !OrigSetThreadAffinityMask)
+        return;
+    if (OrigSetThreadAffinityMask(ts->hThread, affinity))
+        ts->affinity = affinity;
+    else
+        Log("SetThreadPartition: SetThreadAffinityMask(%u, %zx) failed GLE=%u", ts->threadId, affinity,
+            GetLastError());
+}
+
+// Undoes what the previous rule did to a thread and applies the new one
+static void ApplyRule(ThreadState* ts, const ThreadRule* prev, const ThreadRule* rule)
+{
+    if (prev && prev->action == RuleRealtime)
+    {
+        SetThreadPriority(ts->hThread, ts->savedPriority);
+        ts->deadlineTicks = 0;
+    }
+    if (prev && (prev->action == RuleEfficiency || prev->action == RulePerformance))
+        SetThreadQos(ts, false, false);
+    if (prev && prev->action == RulePartition)
+        SetThreadPartition(ts, 0);
+
+    if (rule && rule->action == RuleRealtime)
+    {
+        ts->savedPriority = GetThreadPriority(ts->hThread);
+        if (!SetThreadPriority(ts->hThread, THREAD_PRIORITY_TIME_CRITICAL) &&
+            !SetThreadPriority(ts->hThread, THREAD_PRIORITY_HIGHEST))
+            Log("ApplyRule: failed to raise priority of thread %u GLE=%u", ts->threadId, GetLastError());
+        ts->reportedMissed = ts->missedDeadlines;
+    }
+    if (rule && (rule->action == RuleEfficiency || rule->action == RulePerformance))
+        SetThreadQos(ts, true, rule->action == RuleEfficiency);
+    if (rule && rule->action == RulePartition)
+        SetThreadPartition(ts, (DWORD_PTR)rule->param);
+}
+
+static ULONG64 MissedDeadlines; // Total over all threads; service thread only
+
+// Keeps a realtime thread's deadline in step with its tick rate and reports ticks that missed it
+static void UpdateDeadline(ThreadState* ts)
+{
+    LONGLONG period = 0;
+
+    if (ts->rule->param)
+        period = QpcFrequency.QuadPart / (LONGLONG)ts->rule->param;
+    else if (FrameDetector_IsLocked(&ts->frames))
+        period = (LONGLONG)ts->frames.period;
+    ts->deadlineTicks = (LONGLONG)((double)period * DEADLINE_SLACK);
+
+    if (ts->missedDeadlines != ts->reportedMissed)
+    {
+        Log("Thread %u missed %llu deadlines (%.2f ms) in the last interval, %llu total", ts->threadId,
+            ts->missedDeadlines - ts->reportedMissed, (double)ts->deadlineTicks * 1000.0 / QpcFrequency.QuadPart,
+            ts->missedDeadlines);
+        MissedDeadlines += ts->missedDeadlines - ts->reportedMissed;
+        ts->reportedMissed = ts->missedDeadlines;
+    }
+}
+
+// Finds the first rule that matches the thread. Names can be set at any time, so this is re-run periodically.
+static const ThreadRule* ClassifyThread(ThreadState* ts)
+{
+    PWSTR name = NULL;
+    const ThreadRule* match = NULL;
+
+    if (!ts->startModuleKnown)
+        ResolveStartModule(ts);
+    if (pGetThreadDescription && FAILED(pGetThreadDescription(ts->hThread, &name)))
+        name = NULL;
+
+    for (const ThreadRule* rule = kThreadRules; rule->action != RuleNone; ++rule)
+    {
+        if (rule->name && !(name && WildcardMatch(rule->name, name)))
+            continue;
+        if (rule->module && !WildcardMatch(rule->module, ts->startModule))
+            continue;
+        match = rule;
+        break;
+    }
+
+    if (match != ts->rule)
+    {
+        Log("Thread %u (%ls, %ls) now matches rule %zd", ts->threadId, name ? name : L"", ts->startModule,
+            match ? match - kThreadRules : -1);
+        ApplyRule(ts, ts->rule, match);
+    }
+    if (name)
+        LocalFree(name);
+    return ts->rule = match;
+}
+
+// Describes a rule by its patterns, e.g. "Worker* engine.dll"
+static void RuleLabel(const ThreadRule* rule, WCHAR* label, size_t size)
+{
+    _snwprintf_s(label, size, _TRUNCATE, L"%ls%ls%ls", rule->name ? rule->name : L"",
+                 rule->name && rule->module ? L" " : L"", rule->module ? rule->module : L"");
+}
+
+// The service thread does all periodic work: classifying threads against the rules and running the throttle cycle.
+// While throttled threads are suspended it must not take any lock that they might hold (heap, loader, ThreadListLock,
+// logging), so all of that is done in Housekeeping() and PublishStats(), which only run while every throttled thread is
+// resumed.
+#define MAX_THROTTLED 64
+
+typedef struct ThrottledThread
+{
+    HANDLE hThread; // Duplicated; owned by the service thread
+    DWORD threadId;
+    unsigned share; // Percent of a CPU
+    bool suspended;
+    LONGLONG since; // QPC of the last suspend/resume
+    LONGLONG runTicks;
+    LONGLONG suspendedTicks;
+    ULONGLONG cpuAtStart; // 100ns units
+} ThrottledThread;
+
+static DWORD ServiceThreadId;
+static ThrottledThread Throttled[MAX_THROTTLED];
+static unsigned ThrottledCount;
+static volatile LONG64 ThrottleGivenBack; // Estimated CPU time given back to other threads, 100ns units
+
+static ULONGLONG GetThreadCpuTime(HANDLE hThread)
+{
+    FILETIME creation, exit, kernel, user;
+
+    if (!GetThreadTimes(hThread, &creation, &exit, &kernel, &user))
+        return 0;
+    return ((ULONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+           ((ULONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime);
+}
+
+static void SetThrottled(ThrottledThread* t, bool suspend, LONGLONG now)
+{
+    if (t->suspended == suspend)
+        return;
+
+    if (suspend ? SuspendThread(t->hThread) == (DWORD)-1 : ResumeThread(t->hThread) == (DWORD)-1)
+        return;
+
+    if (suspend)
+        t->runTicks += now - t->since;
+    else
+        t->suspendedTicks += now - t->since;
+    t->suspended = suspend;
+    t->since = now;
+}
+
+// Resumes everything and releases the throttle list, accounting for the CPU time that was given back: the time each
+// thread spent suspended, times how busy it was while it was allowed to run.
+static void ReleaseThrottled()
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    for (unsigned i = 0; i < ThrottledCount; ++i)
+    {
+        ThrottledThread* t = &Throttled[i];
+        ULONGLONG cpu;
+        double busy;
+
+        SetThrottled(t, false, now.QuadPart);
+        t->runTicks += now.QuadPart - t->since;
+
+        cpu = GetThreadCpuTime(t->hThread) - t->cpuAtStart;
+        busy = t->runTicks ? (double)cpu / ((double)t->runTicks * 1e7 / (double)QpcFrequency.QuadPart) : 0.0;
+        InterlockedAdd64(&ThrottleGivenBack,
+                         (LONG64)((double)t->suspendedTicks * 1e7 / (double)QpcFrequency.QuadPart * min(busy, 1.0)));
+        CloseHandle(t->hThread);
+    }
+    ThrottledCount = 0;
+}
+
+#if MIGRATION_DAMPING
+static ULONG64 MigrationsTotal; // Service thread only
+
+// Picks the processor the thread woke up on most out of those it is placed on (so a partition is kept to), preferring
+// ones that no other thread is pinned to
+static unsigned PickPinCpu(const ThreadState* ts)
+{
+    DWORD_PTR allowed = (ts->affinity & EnforcedMask) ? (ts->affinity & EnforcedMask) : EnforcedMask;
+    unsigned best = 0;
+    bool found = false;
+
+    for (unsigned cpu = 0; cpu < _countof(ts->cpuHits); ++cpu)
+    {
+        if (!(allowed & ((DWORD_PTR)1 << cpu)))
+            continue;
+        if (!found || PinnedPerCpu[cpu] < PinnedPerCpu[best] ||
+            (PinnedPerCpu[cpu] == PinnedPerCpu[best] && ts->cpuHits[cpu] > ts->cpuHits[best]))
+            best = cpu;
+        found = true;
+    }
+    return best;
+}
+
+// Returns the thread to where it was before the pin, unless the app has set its affinity since, in which case the app's
+// choice stands
+static void UnpinThread(ThreadState* ts)
+{
+    DWORD_PTR affinity = (ts->affinityBeforePin & EnforcedMask) ? (ts->affinityBeforePin & EnforcedMask) : EnforcedMask;
+    DWORD_PTR current = GetThreadMask(ts->hThread);
+
+    if (current && current != ((DWORD_PTR)1 << ts->pinnedCpu))
+        ts->affinity = current;
+    else if (affinity && OrigSetThreadAffinityMask(ts->hThread, affinity))
+        ts->affinity = affinity;
+    InterlockedDecrement(&PinnedPerCpu[ts->pinnedCpu]);
+    ts->pinned = false;
+}
+
+// Pins threads that bounce between processors too often, and lets them go again after a while. ThreadListLock must be
+// held.
+static void DampMigrations(ThreadState* ts, double seconds)
+{
+    ULONG64 moved = ts->migrations - ts->reportedMigrations;
+    DWORD_PTR prev;
+    unsigned cpu;
+
+    ts->reportedMigrations = ts->migrations;
+    ts->migrationRate = seconds > 0.0 ? (unsigned)((double)moved / seconds) : 0;
+    MigrationsTotal += moved;
+
+    if (ts->pinned)
+    {
+        if (--ts->pinnedPasses == 0)
+        {
+            Log("Thread %u: lifting pin from CPU %u", ts->threadId, ts->pinnedCpu);
+            UnpinThread(ts);
+        }
+        return;
+    }
+    if (ts->migrationRate <= MIGRATION_RATE_LIMIT || !EnforcedMask)
+        return;
+
+    cpu = PickPinCpu(ts);
+    if (!(prev = OrigSetThreadAffinityMask(ts->hThread, (DWORD_PTR)1 << cpu)))
+    {
+        Log("DampMigrations: SetThreadAffinityMask(%u) failed GLE=%u", ts->threadId, GetLastError());
+        return;
+    }
+    Log("Thread %u migrated %u times/s; pinning to CPU %u", ts->threadId, ts->migrationRate, cpu);
+    InterlockedIncrement(&PinnedPerCpu[cpu]);
+    ts->affinityBeforePin = prev;
+    ts->affinity = (DWORD_PTR)1 << cpu;
+    ts->pinned = true;
+    ts->pinnedCpu = cpu;
+    ts->pinnedPasses = max(MIGRATION_HOLD_SECONDS * 1000 / SERVICE_INTERVAL_MS, 1);
+}
+#endif
+
+#if TICK_TARGET_MS
+static TickController Tick;
+static DWORD_PTR TickBaseMask; // The enforced set before the controller started resizing it
+static LONG TickTail;
+
+// Moves threads that are still on the old enforced set onto the new one. Threads that were pinned elsewhere (by the
+// app or the pool) are left alone; their affinity is read first so that they are never written to. ThreadListLock must
+// be held exclusively: EnforcedMask and each thread's affinity change together, and threads attaching meanwhile are
+// placed on one set or the other, never on a stale one.
+static void ResizeEnforcedSet(DWORD_PTR mask)
+{
+    DWORD_PTR old = EnforcedMask;
+
+    EnforcedMask = mask;
+    for (ThreadState* ts = ThreadList; ts; ts = ts->next)
+    {
+#    if MIGRATION_DAMPING
+        // A damped thread goes back to the new set when its pin is lifted, and is let go now if its processor is gone
+        if (ts->pinned)
+        {
+            if (ts->affinityBeforePin == old)
+                ts->affinityBeforePin = mask;
+            if (!(mask & ((DWORD_PTR)1 << ts->pinnedCpu)))
+                UnpinThread(ts);
+            continue;
+        }
+#    endif
+        if (ts->rule && ts->rule->action == RulePartition)
+            SetThreadPartition(ts, (DWORD_PTR)ts->rule->param);
+        else if (GetThreadMask(ts->hThread) == old && OrigSetThreadAffinityMask(ts->hThread, mask))
+            ts->affinity = mask;
+    }
+}
+
+// Feeds the ticks recorded since the last pass to the controller. Returns the enforced set it asks for, or 0 if it is
+// unchanged. ThreadListLock must be held (shared is enough).
+static DWORD_PTR UpdateTickController(ThreadState* tickThread)
+{
+    LONG head = TickHead;
+    uint32_t prev = Tick.cores, cores;
+    DWORD_PTR mask = 0;
+
+    TickThread = tickThread;
+    if (head - TickTail > TICK_RING)
+        TickTail = head - TICK_RING;
+    for (; TickTail != head; ++TickTail)
+        TickController_AddTick(&Tick, TickRing[(ULONG)TickTail % TICK_RING]);
+
+    if ((cores = TickController_Update(&Tick)) == prev)
+        return 0;
+
+    // Keep the lowest `cores` processors of the original set
+    for (DWORD_PTR bits = TickBaseMask; bits && cores; bits &= bits - 1, --cores)
+        mask |= bits & (~bits + 1);
+    Log("Tick controller: p99 %.2f ms (target %.2f ms), CPUs %u -> %u, mask %zx", Tick.lastP99, Tick.targetMs, prev,
+        Tick.cores, mask);
+    return mask;
+}
+#endif
+
+#if OVERHEAD_BUDGET_PERMILLE
+// Cycles spent per feature; service thread only
+static ULONG64 FeatureCycles[FeatureCount];
+static const char* const kFeatureNames[FeatureCount] = { "frame detection", "housekeeping", "throttling" };
+static const unsigned kFeatureMaxLevel[FeatureCount] = { 1, 4, 3 };
+
+static ULONG64 CurrentThreadCycles()
+{
+    ULONG64 cycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    return cycles;
+}
+
+// Passes that the overhead has to stay under half the budget before the last step is undone. Doubled (up to the max)
+// whenever a feature that was just given back has to be degraded again, so one that doesn't fit doesn't flap.
+#    define OVERHEAD_RESTORE_PASSES 10
+#    define OVERHEAD_RESTORE_MAX_PASSES 640
+
+static Feature DegradeSteps[1 + 4 + 3]; // The governor's steps, most recent last; room for every kFeatureMaxLevel
+static unsigned DegradeStepCount;
+static unsigned OverheadPermille; // The limiter's share of process CPU time over the last pass
+
+// Log is compiled out of release builds, but the governor's steps change what the limiter does, so they always go out
+static void ReportOverhead(const char* format, ...)
+{
+    char buffer[256] = "CpuLimiter: ";
+    size_t len = strlen(buffer);
+    va_list ap;
+
+    va_start(ap, format);
+    if (vsnprintf(buffer + len, sizeof(buffer) - len - 1, format, ap) < 0)
+        buffer[len] = '\0';
+    va_end(ap);
+    strcat_s(buffer, sizeof(buffer), "\n");
+    OutputDebugStringA(buffer);
+}
+
+// Compares the limiter's own cycles since the last pass to the whole process's. Over budget, degrades the most
+// expensive feature that still can be; well under it for long enough, undoes the last step.
+static void GovernOverhead()
+{
+    static ULONG64 lastProcess, lastFeature[FeatureCount];
+    static unsigned quietPasses, restorePasses = OVERHEAD_RESTORE_PASSES;
+    static int restored = -1;
+    ULONG64 process = 0, processDelta, total = 0, delta[FeatureCount];
+    bool first = !lastProcess;
+    int worst = -1;
+    Feature f;
+
+    QueryProcessCycleTime(GetCurrentProcess(), &process);
+    processDelta = process - lastProcess;
+    lastProcess = process;
+    for (int i = 0; i < FeatureCount; ++i)
+    {
+        delta[i] = FeatureCycles[i] - lastFeature[i];
+        lastFeature[i] = FeatureCycles[i];
+        total += delta[i];
+        if (FeatureLevel[i] < kFeatureMaxLevel[i] && delta[i] && (worst < 0 || delta[i] > delta[worst]))
+            worst = i;
+    }
+    if (first || !processDelta)
+        return;
+    OverheadPermille = (unsigned)min(total * 1000 / processDelta, 1000);
+
+    if (total * 1000 > processDelta * OVERHEAD_BUDGET_PERMILLE)
+    {
+        quietPasses = 0;
+        if (worst < 0 || DegradeStepCount == _countof(DegradeSteps))
+            return;
+        if (worst == restored)
+            restorePasses = min(restorePasses * 2, OVERHEAD_RESTORE_MAX_PASSES);
+        restored = -1;
+
+        f = (Feature)worst;
+        DegradeSteps[DegradeStepCount++] = f;
+        if (++FeatureLevel[f] == kFeatureMaxLevel[f] && f == FeatureFrames)
+            InterlockedOr(&FeaturesDisabled, 1 << f);
+        ReportOverhead("overhead %.2f%% of process CPU is over the %.1f%% budget; %s %s (level %u)",
+                       OverheadPermille / 10.0, OVERHEAD_BUDGET_PERMILLE / 10.0, kFeatureNames[f],
+                       IsFeatureDisabled(f) ? "turned off" : "degraded", FeatureLevel[f]);
+        return;
+    }
+
+    // Hysteresis: only well under the budget counts toward giving a step back
+    if (!DegradeStepCount || total * 2000 > processDelta * OVERHEAD_BUDGET_PERMILLE)
+    {
+        quietPasses = 0;
+        return;
+    }
+    if (++quietPasses < restorePasses)
+        return;
+    quietPasses = 0;
+
+    f = DegradeSteps[--DegradeStepCount];
+    restored = f;
+    --FeatureLevel[f];
+    InterlockedAnd(&FeaturesDisabled, ~(1 << f));
+    ReportOverhead("overhead %.2f%% of process CPU is well under the %.1f%% budget; %s restored to level %u",
+                   OverheadPermille / 10.0, OVERHEAD_BUDGET_PERMILLE / 10.0, kFeatureNames[f], FeatureLevel[f]);
+}
+#endif
+
+#if POOL_EFFICIENCY
+#    define MAX_POOLS STATS_MAX_POOLS
+// Pools are logged every this many housekeeping passes
+#    define POOL_LOG_PASSES 10
+
+typedef struct PoolStats
+{
+    WCHAR label[STATS_LABEL_LENGTH];
+    unsigned seen;      // Threads sampled in the current pass
+    ULONG64 busy;       // CPU time (100ns units) in the current pass
+    LONGLONG waitTicks; // Time blocked in hooked waits in the current pass
+    unsigned threads;   // As of the last complete pass
+    double parallelism; // Average number of the pool's threads running over the last interval
+    double peakParallelism;
+    double efficiency;  // parallelism over the CPUs the pool could have kept busy
+    double waitShare;   // Share of the pool's thread time spent blocked in hooked waits
+} PoolStats;
+
+static PoolStats Pools[MAX_POOLS]; // Service thread only
+static unsigned PoolCount;
+
+static PoolStats* FindPool(const WCHAR* name)
+{
+    WCHAR label[STATS_LABEL_LENGTH];
+
+    wcsncpy_s(label, _countof(label), name, _TRUNCATE);
+    for (unsigned i = 0; i < PoolCount; ++i)
+    {
+        if (!wcscmp(Pools[i].label, label))
+            return &Pools[i];
+    }
+    // The last pool collects whatever doesn't fit
+    if (PoolCount == MAX_POOLS)
+        return &Pools[MAX_POOLS - 1];
+    wcscpy_s(Pools[PoolCount].label, STATS_LABEL_LENGTH, PoolCount == MAX_POOLS - 1 ? L"(other)" : label);
+    return &Pools[PoolCount++];
+}
+
+// Adds a thread's CPU and wait time since its last sample to its pool. A wait still in progress counts up to `now`.
+static void SamplePoolThread(ThreadState* ts, LONGLONG now)
+{
+    WCHAR label[STATS_LABEL_LENGTH];
+    ULONG64 cpu = GetThreadCpuTime(ts->hThread);
+    LONGLONG waitStart = ts->waitStart;
+    LONGLONG waited = ts->waitTicks + (waitStart ? now - waitStart : 0);
+    PoolStats* pool;
+
+    if (ts->rule)
+        RuleLabel(ts->rule, label, _countof(label));
+    else if (ts->startSymbol[0])
+        wcscpy_s(label, _countof(label), ts->startSymbol);
+    else
+        wcsncpy_s(label, _countof(label), ts->startModule[0] ? ts->startModule : L"(unknown)", _TRUNCATE);
+    pool = FindPool(label);
+    ++pool->seen;
+
+    // The first sample of a thread only sets its baseline
+    if (ts->poolSampled)
+    {
+        pool->busy += cpu - ts->poolCpuTime;
+        if (waited > ts->poolWaitTicks)
+            pool->waitTicks += waited - ts->poolWaitTicks;
+    }
+    ts->poolSampled = true;
+    ts->poolCpuTime = cpu;
+    ts->poolWaitTicks = max(waited, ts->poolWaitTicks);
+}
+
+// Turns the pass's samples into per-pool figures
+static void UpdatePools(double seconds, bool log)
+{
+    unsigned cpus = 0;
+
+    for (DWORD_PTR bits = EnforcedMask; bits; bits &= bits - 1)
+        ++cpus;
+    if (!cpus)
+        cpus = kNumCpus;
+
+    for (unsigned i = 0; i < PoolCount; ++i)
+    {
+        PoolStats* pool = &Pools[i];
+
+        pool->threads = pool->seen;
+        if (seconds > 0.0 && pool->threads)
+        {
+            pool->parallelism = (double)pool->busy / (1e7 * seconds);
+            pool->peakParallelism = max(pool->peakParallelism, pool->parallelism);
+            pool->efficiency = pool->parallelism / min(pool->threads, cpus);
+            pool->waitShare = min((double)pool->waitTicks / QpcFrequency.QuadPart / (seconds * pool->threads), 1.0);
+        }
+        else
+            pool->parallelism = pool->efficiency = pool->waitShare = 0.0;
+
+        if (log && pool->threads)
+            Log("Pool %ls: %u threads, parallelism %.2f (peak %.2f) of %u CPUs, efficiency %.0f%%, waiting %.0f%%",
+                pool->label, pool->threads, pool->parallelism, pool->peakParallelism, cpus, pool->efficiency * 100.0,
+                pool->waitShare * 100.0);
+        pool->seen = 0;
+        pool->busy = 0;
+        pool->waitTicks = 0;
+    }
+}
+#endif
+
+#if METRICS
+#    define METRICS_BUFFER_SIZE 32768
+
+// Text is formatted into the buffer that doesn't hold the last complete snapshot, so nothing is allocated per pass and
+// the previous snapshot stays intact if formatting fails part-way.
+static char MetricsBuffers[2][METRICS_BUFFER_SIZE];
+static unsigned MetricsCurrent;                         // Index of the last complete snapshot
+static unsigned ThreadsPerRule[_countof(kThreadRules)]; // The last entry counts threads that no rule matches
+static WCHAR MetricsPath[MAX_PATH];
+static WCHAR MetricsTempPath[MAX_PATH];
+
+typedef struct MetricsText
+{
+    char* buf;
+    size_t len;
+} MetricsText;
+
+static void Emit(MetricsText* m, const char* format, ...)
+{
+    va_list ap;
+    int ret;
+
+    if (m->len >= METRICS_BUFFER_SIZE)
+        return;
+    va_start(ap, format);
+    ret = vsnprintf(m->buf + m->len, METRICS_BUFFER_SIZE - m->len, format, ap);
+    va_end(ap);
+    m->len = ret < 0 ? METRICS_BUFFER_SIZE : min(m->len + ret, METRICS_BUFFER_SIZE);
+}
+
+static void WriteMetrics()
+{
+    MetricsText m = { MetricsBuffers[!MetricsCurrent], 0 };
+    DWORD pid = GetCurrentProcessId(), written;
+    ULONG64 processCycles = 0, calls[CountedHooks];
+    FrameStats frames;
+    unsigned cpus = 0;
+    HANDLE hFile;
+    BOOL ok;
+
+    if (!MetricsPath[0])
+    {
+        swprintf_s(MetricsPath, _countof(MetricsPath), L"%ls\\cpulimiter_%u.prom", METRICS_DIR, pid);
+        swprintf_s(MetricsTempPath, _countof(MetricsTempPath), L"%ls.tmp", MetricsPath);
+    }
+
+    AcquireSRWLockShared(&ThreadListLock);
+    for (int i = 0; i < CountedHooks; ++i)
+        calls[i] = HookCalls[i].calls + ExitedHookCalls[i];
+    for (const ThreadState* ts = ThreadList; ts; ts = ts->next)
+    {
+        for (int i = 0; i < CountedHooks; ++i)
+            calls[i] += ts->hookCalls[i];
+    }
+    ReleaseSRWLockShared(&ThreadListLock);
+    Emit(&m, "# TYPE cpulimiter_hook_calls_total counter\n");
+    for (int i = 0; i < CountedHooks; ++i)
+        Emit(&m, "cpulimiter_hook_calls_total{pid=\"%u\",hook=\"%s\"} %llu\n", pid, kCountedHookNames[i], calls[i]);
+
+    for (DWORD_PTR bits = EnforcedMask; bits; bits &= bits - 1)
+        ++cpus;
+    Emit(&m, "# TYPE cpulimiter_enforced_cpus gauge\ncpulimiter_enforced_cpus{pid=\"%u\"} %u\n", pid, cpus);
+    Emit(&m, "# TYPE cpulimiter_reported_cpus gauge\ncpulimiter_reported_cpus{pid=\"%u\"} %u\n", pid,
+         ReportedCpuCount(kReportedCpus));
+
+    Emit(&m, "# TYPE cpulimiter_threads gauge\n");
+    for (size_t i = 0; i < _countof(kThreadRules); ++i)
+    {
+        if (i + 1 < _countof(kThreadRules))
+            Emit(&m, "cpulimiter_threads{pid=\"%u\",rule=\"%zu\"} %u\n", pid, i, ThreadsPerRule[i]);
+        else
+            Emit(&m, "cpulimiter_threads{pid=\"%u\",rule=\"none\"} %u\n", pid, ThreadsPerRule[i]);
+    }
+
+    Emit(&m, "# TYPE cpulimiter_throttle_given_back_seconds_total counter\n");
+    Emit(&m, "cpulimiter_throttle_given_back_seconds_total{pid=\"%u\"} %.3f\n", pid, (double)ThrottleGivenBack / 1e7);
+    Emit(&m, "# TYPE cpulimiter_missed_deadlines_total counter\n");
+    Emit(&m, "cpulimiter_missed_deadlines_total{pid=\"%u\"} %llu\n", pid, MissedDeadlines);
+
+#    if MIGRATION_DAMPING
+    Emit(&m, "# TYPE cpulimiter_migrations_total counter\ncpulimiter_migrations_total{pid=\"%u\"} %llu\n", pid,
+         MigrationsTotal);
+    Emit(&m, "# TYPE cpulimiter_pinned_threads gauge\n");
+    for (unsigned cpu = 0; cpu < _countof(PinnedPerCpu); ++cpu)
+    {
+        if (PinnedPerCpu[cpu])
+            Emit(&m, "cpulimiter_pinned_threads{pid=\"%u\",cpu=\"%u\"} %ld\n", pid, cpu, PinnedPerCpu[cpu]);
+    }
+#    endif
+
+#    if POOL_EFFICIENCY
+    Emit(&m, "# TYPE cpulimiter_pool_threads gauge\n");
+    for (unsigned i = 0; i < PoolCount; ++i)
+        Emit(&m, "cpulimiter_pool_threads{pid=\"%u\",pool=\"%ls\"} %u\n", pid, Pools[i].label, Pools[i].threads);
+    Emit(&m, "# TYPE cpulimiter_pool_parallelism gauge\n");
+    for (unsigned i = 0; i < PoolCount; ++i)
+    {
+        Emit(&m, "cpulimiter_pool_parallelism{pid=\"%u\",pool=\"%ls\",stat=\"current\"} %.3f\n", pid, Pools[i].label,
+             Pools[i].parallelism);
+        Emit(&m, "cpulimiter_pool_parallelism{pid=\"%u\",pool=\"%ls\",stat=\"peak\"} %.3f\n", pid, Pools[i].label,
+             Pools[i].peakParallelism);
+    }
+    Emit(&m, "# TYPE cpulimiter_pool_efficiency gauge\n");
+    for (unsigned i = 0; i < PoolCount; ++i)
+        Emit(&m, "cpulimiter_pool_efficiency{pid=\"%u\",pool=\"%ls\"} %.3f\n", pid, Pools[i].label,
+             Pools[i].efficiency);
+    Emit(&m, "# TYPE cpulimiter_pool_wait_ratio gauge\n");
+    for (unsigned i = 0; i < PoolCount; ++i)
+        Emit(&m, "cpulimiter_pool_wait_ratio{pid=\"%u\",pool=\"%ls\"} %.3f\n", pid, Pools[i].label,
+             Pools[i].waitShare);
+#    endif
+
+    if (GetProcessFrameStats(&frames))
+    {
+        Emit(&m, "# TYPE cpulimiter_frames_total counter\n");
+        Emit(&m, "cpulimiter_frames_total{pid=\"%u\"} %llu\n", pid, frames.frames);
+        Emit(&m, "# TYPE cpulimiter_frame_time_ms gauge\n");
+        Emit(&m, "cpulimiter_frame_time_ms{pid=\"%u\",stat=\"avg\"} %.3f\n", pid, frames.avgMs);
+        Emit(&m, "cpulimiter_frame_time_ms{pid=\"%u\",stat=\"jitter\"} %.3f\n", pid, frames.jitterMs);
+    }
+
+    QueryProcessCycleTime(GetCurrentProcess(), &processCycles);
+    Emit(&m, "# TYPE cpulimiter_process_cycles_total counter\ncpulimiter_process_cycles_total{pid=\"%u\"} %llu\n", pid,
+         processCycles);
+#    if OVERHEAD_BUDGET_PERMILLE
+    Emit(&m, "# TYPE cpulimiter_overhead_cycles_total counter\n");
+    for (int f = 0; f < FeatureCount; ++f)
+        Emit(&m, "cpulimiter_overhead_cycles_total{pid=\"%u\",feature=\"%s\"} %llu\n", pid, kFeatureNames[f],
+             FeatureCycles[f]);
+    Emit(&m, "# TYPE cpulimiter_feature_level gauge\n");
+    for (int f = 0; f < FeatureCount; ++f)
+        Emit(&m, "cpulimiter_feature_level{pid=\"%u\",feature=\"%s\"} %u\n", pid, kFeatureNames[f], FeatureLevel[f]);
+#    endif
+
+    if (m.len >= METRICS_BUFFER_SIZE)
+    {
+        Log("WriteMetrics: buffer too small");
+        return;
+    }
+
+    // Write aside and rename over the old file so a scrape never sees a partial file
+    hFile = CreateFileW(MetricsTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        Log("WriteMetrics: CreateFile(%ls) failed GLE=%u", MetricsTempPath, GetLastError());
+        return;
+    }
+    ok = WriteFile(hFile, m.buf, (DWORD)m.len, &written, NULL) && written == m.len;
+    CloseHandle(hFile);
+    if (!ok || !MoveFileExW(MetricsTempPath, MetricsPath, MOVEFILE_REPLACE_EXISTING))
+        Log("WriteMetrics: failed to write %ls GLE=%u", MetricsPath, GetLastError());
+    else
+        MetricsCurrent = !MetricsCurrent;
+}
+
+// A stale file would keep being scraped after the process is gone
+static void RemoveMetrics()
+{
+    if (MetricsPath[0])
+        DeleteFileW(MetricsPath);
+}
+#endif
+
+#if STATS_SECTION
+static StatsSection* Stats;
+
+static void InitStats()
+{
+    WCHAR name[64];
+    HANDLE hMapping;
+
+    // The mapping handle is never closed, so the section lives as long as the process does
+    swprintf_s(name, _countof(name), STATS_SECTION_NAME_FORMAT, GetCurrentProcessId());
+    if (!(hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(StatsSection), name)) ||
+        !(Stats = (StatsSection*)MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, sizeof(StatsSection))))
+    {
+        Log("InitStats: failed to create %ls GLE=%u", name, GetLastError());
+        return;
+    }
+
+    Stats->version = STATS_SECTION_VERSION;
+    Stats->pid = GetCurrentProcessId();
+    Stats->intervalMs = STATS_INTERVAL_MS;
+    Stats->numCpus = kNumCpus;
+    for (unsigned v = 0; v < kReportedCpus && v < STATS_MAX_CPUS; ++v)
+    {
+        ULONG_PTR mask = FoldMask((ULONG_PTR)1 << v);
+        unsigned cpu = 0;
+        for (; mask && !(mask & 1); mask >>= 1)
+            ++cpu;
+        Stats->virtualToPhysical[v] = (uint8_t)cpu;
+    }
+
+    for (const ThreadRule* rule = kThreadRules; rule->action != RuleNone && Stats->ruleCount < STATS_MAX_RULES; ++rule)
+    {
+        RuleLabel(rule, (WCHAR*)Stats->ruleLabels[Stats->ruleCount++], STATS_LABEL_LENGTH);
+    }
+}
+
+static void PublishStats()
+{
+    static LARGE_INTEGER last;
+    LARGE_INTEGER now;
+    FrameStats frames;
+    double seconds;
+    bool haveFrames;
+    unsigned count = 0;
+
+    if (!Stats)
+        return;
+
+    haveFrames = GetProcessFrameStats(&frames);
+    QueryPerformanceCounter(&now);
+    seconds = last.QuadPart ? (double)(now.QuadPart - last.QuadPart) / (double)QpcFrequency.QuadPart : 0.0;
+    last = now;
+
+    InterlockedIncrement((volatile LONG*)&Stats->sequence);
+    Stats->reportedCpus = ReportedCpuCount(kReportedCpus);
+    Stats->enforcedMask = EnforcedMask;
+    Stats->frameAvgMs = haveFrames ? frames.avgMs : 0.0;
+    Stats->frameJitterMs = haveFrames ? frames.jitterMs : 0.0;
+#    if OVERHEAD_BUDGET_PERMILLE
+    Stats->overheadPermille = OverheadPermille;
+    for (int f = 0; f < FeatureCount && f < STATS_MAX_FEATURES; ++f)
+        Stats->featureLevels[f] = (uint8_t)FeatureLevel[f];
+#    endif
+
+    AcquireSRWLockShared(&ThreadListLock);
+    for (ThreadState* ts = ThreadList; ts && count < STATS_MAX_THREADS; ts = ts->next)
+    {
+        StatsThread* st = &Stats->threads[count++];
+        ULONG64 cpu = GetThreadCpuTime(ts->hThread);
+        PROCESSOR_NUMBER ideal;
+
+        st->threadId = ts->threadId;
+        st->rule = ts->rule ? (int32_t)(ts->rule - kThreadRules) : -1;
+        st->idealCpu = GetThreadIdealProcessorEx(ts->hThread, &ideal) ? ideal.Number : 0;
+        // 100ns units to per mille of a CPU
+        st->utilization =
+            seconds > 0.0 && ts->lastCpuTime ? (uint32_t)((double)(cpu - ts->lastCpuTime) / (1e4 * seconds)) : 0;
+        st->affinity = ts->affinity;
+        st->lastCpu = ts->lastCpu;
+        st->migrationRate = ts->migrationRate;
+        st->pinnedCpu = ts->pinned ? (int32_t)ts->pinnedCpu : -1;
+        wcsncpy_s((wchar_t*)st->startModule, STATS_LABEL_LENGTH, ts->startModule, _TRUNCATE);
+        ts->lastCpuTime = cpu;
+    }
+    ReleaseSRWLockShared(&ThreadListLock);
+
+    Stats->threadCount = count;
+#    if POOL_EFFICIENCY
+    for (unsigned i = 0; i < PoolCount; ++i)
+    {
+        StatsPool* sp = &Stats->pools[i];
+        wcsncpy_s((wchar_t*)sp->label, STATS_LABEL_LENGTH, Pools[i].label, _TRUNCATE);
+        sp->threads = Pools[i].threads;
+        sp->parallelism = (uint32_t)(Pools[i].parallelism * 1000.0);
+        sp->peakParallelism = (uint32_t)(Pools[i].peakParallelism * 1000.0);
+        sp->efficiency = (uint32_t)(Pools[i].efficiency * 1000.0);
+        sp->waitShare = (uint32_t)(Pools[i].waitShare * 1000.0);
+    }
+    Stats->poolCount = PoolCount;
+#    endif
+    ++Stats->updates;
+    InterlockedIncrement((volatile LONG*)&Stats->sequence);
+}
+
+// Stats go out on their own STATS_INTERVAL_MS tick, called from the service thread's waits between housekeeping passes.
+// Like Housekeeping() it takes ThreadListLock, so it must not be called while a throttled thread is suspended. Returns
+// when the next update is due.
+static LONGLONG PublishStatsIfDue(LONGLONG now)
+{
+    static LONGLONG next;
+
+    if (now >= next)
+    {
+        PublishStats();
+        next = now + QpcFrequency.QuadPart * STATS_INTERVAL_MS / 1000;
+    }
+    return next;
+}
+#endif
+
+static unsigned HousekeepingPass;
+
+static void Housekeeping()
+{
+    static LARGE_INTEGER last;
+    LARGE_INTEGER now;
+    double seconds;
+#if TICK_TARGET_MS
+    ThreadState* tickThread = NULL;
+    DWORD_PTR resize;
+#endif
+
+#if METRICS
+    memset(ThreadsPerRule, 0, sizeof(ThreadsPerRule));
+#endif
+    AcquireSRWLockShared(&ThreadListLock);
+    QueryPerformanceCounter(&now);
+    seconds = last.QuadPart ? (double)(now.QuadPart - last.QuadPart) / (double)QpcFrequency.QuadPart : 0.0;
+    last = now;
+    for (ThreadState* ts = ThreadList; ts; ts = ts->next)
+    {
+        const ThreadRule* rule;
+        ThrottledThread* t;
+
+#if OVERHEAD_BUDGET_PERMILLE
+        FeatureCycles[FeatureFrames] += ts->hookCycles - ts->reportedHookCycles;
+        ts->reportedHookCycles = ts->hookCycles;
+#endif
+#if TICK_TARGET_MS
+        if (FrameDetector_IsLocked(&ts->frames) && (!tickThread || ts->frames.frames > tickThread->frames.frames))
+            tickThread = ts;
+#endif
+        if (ts->threadId == ServiceThreadId)
+            continue;
+#if MIGRATION_DAMPING
+        DampMigrations(ts, seconds);
+#endif
+        // Rules are re-checked less often when the governor has degraded housekeeping
+        rule = (HousekeepingPass & ((1u << FeatureLevel[FeatureHousekeeping]) - 1)) ? ts->rule : ClassifyThread(ts);
+#if POOL_EFFICIENCY
+        SamplePoolThread(ts, now.QuadPart);
+#endif
+#if METRICS
+        ++ThreadsPerRule[rule ? rule - kThreadRules : _countof(kThreadRules) - 1];
+#endif
+        if (!rule)
+            continue;
+        if (rule->action == RuleRealtime)
+            UpdateDeadline(ts);
+        if (rule->action != RuleThrottle || ThrottledCount == MAX_THROTTLED)
+            continue;
+
+        t = &Throttled[ThrottledCount];
+        if (!DuplicateHandle(GetCurrentProcess(), ts->hThread, GetCurrentProcess(), &t->hThread, 0, FALSE,
+                             DUPLICATE_SAME_ACCESS))
+            continue;
+        t->threadId = ts->threadId;
+        t->share = (unsigned)min(rule->param, 100);
+        t->suspended = false;
+        t->since = now.QuadPart;
+        t->runTicks = t->suspendedTicks = 0;
+        t->cpuAtStart = GetThreadCpuTime(t->hThread);
+        ++ThrottledCount;
+    }
+#if TICK_TARGET_MS
+    resize = UpdateTickController(tickThread);
+#endif
+    ReleaseSRWLockShared(&ThreadListLock);
+#if TICK_TARGET_MS
+    if (resize)
+    {
+        AcquireSRWLockExclusive(&ThreadListLock);
+        ResizeEnforcedSet(resize);
+        ReleaseSRWLockExclusive(&ThreadListLock);
+    }
+#endif
+#if JOBSERVER
+    BalanceJobserverTokens(seconds);
+#endif
+#if POOL_EFFICIENCY
+    UpdatePools(seconds, HousekeepingPass % POOL_LOG_PASSES == 0);
+#endif
+    ++HousekeepingPass;
+
+#if METRICS
+    WriteMetrics();
+#endif
+
+#if OVERHEAD_BUDGET_PERMILLE
+    GovernOverhead();
+#endif
+
+    Log("Housekeeping: %u throttled threads, %.3f s of CPU given back so far", ThrottledCount,
+        (double)ThrottleGivenBack / 1e7);
+}
+
+static DWORD WINAPI ServiceThreadProc(LPVOID param)
+{
+    const LONGLONG period = QpcFrequency.QuadPart * THROTTLE_PERIOD_MS / 1000;
+
+    for (;;)
+    {
+        LARGE_INTEGER now;
+        LONGLONG end;
+#if OVERHEAD_BUDGET_PERMILLE
+        ULONG64 cycles = CurrentThreadCycles();
+#endif
+
+        Housekeeping();
+#if OVERHEAD_BUDGET_PERMILLE
+        FeatureCycles[FeatureHousekeeping] += CurrentThreadCycles() - cycles;
+        cycles = CurrentThreadCycles();
+#endif
+
+        QueryPerformanceCounter(&now);
+        end = now.QuadPart + QpcFrequency.QuadPart * SERVICE_INTERVAL_MS / 1000;
+        if (!ThrottledCount)
+        {
+#if STATS_SECTION
+            // Sleep out the interval, waking for each stats update
+            for (; now.QuadPart < end; QueryPerformanceCounter(&now))
+            {
+                LONGLONG until = min(PublishStatsIfDue(now.QuadPart), end);
+                Sleep((DWORD)max((until - now.QuadPart) * 1000 / QpcFrequency.QuadPart, 1));
+            }
+#    if OVERHEAD_BUDGET_PERMILLE
+            FeatureCycles[FeatureHousekeeping] += CurrentThreadCycles() - cycles;
+#    endif
+#else
+            Sleep(SERVICE_INTERVAL_MS);
+#endif
+            continue;
+        }
+
+        // Each throttled thread runs for the first `share` percent of every period. The phase is computed from the
+        // clock, so coarse Sleep granularity only costs resolution, not accuracy.
+        for (; now.QuadPart < end; QueryPerformanceCounter(&now))
+        {
+            LONGLONG phase = now.QuadPart % period;
+            bool suspended = false;
+            for (unsigned i = 0; i < ThrottledCount; ++i)
+            {
+                SetThrottled(&Throttled[i], phase >= period * Throttled[i].share / 100, now.QuadPart);
+                suspended = suspended || Throttled[i].suspended;
+            }
+#if STATS_SECTION
+            // PublishStats takes ThreadListLock, so it waits for the start of a period, when every thread is running
+            if (!suspended)
+                PublishStatsIfDue(now.QuadPart);
+#endif
+            Sleep(max((THROTTLE_PERIOD_MS << FeatureLevel[FeatureThrottle]) / 20, 1));
+        }
+        ReleaseThrottled();
+#if STATS_SECTION
+        // In case no period started with every thread running (a share of 0 never runs)
+        QueryPerformanceCounter(&now);
+        PublishStatsIfDue(now.QuadPart);
+#endif
+#if OVERHEAD_BUDGET_PERMILLE
+        FeatureCycles[FeatureThrottle] += CurrentThreadCycles() - cycles;
+#endif
+    }
+}
+
+static void StartServiceThread()
+{
+    HANDLE hThread;
+    HMODULE hKernel32 = GetModuleHandleW(L"Kernel32.dll"), hNtdll = GetModuleHandleW(L"ntdll.dll");
+    bool needed = kThreadRules[0].action != RuleNone || TICK_TARGET_MS || METRICS || STATS_SECTION || POOL_EFFICIENCY;
+
+#if JOBSERVER
+    // Jobserver tokens are handed back from the service thread as the process goes idle
+    needed = needed || (JobserverSemaphore && !JobserverRoot);
+#endif
+    if (!needed)
+        return;
+
+#if STATS_SECTION
+    InitStats();
+#endif
+
+#if TICK_TARGET_MS
+    uint32_t cpus = 0;
+    for (DWORD_PTR bits = EnforcedMask; bits; bits &= bits - 1)
+        ++cpus;
+    TickBaseMask = EnforcedMask;
+    TickController_Init(&Tick, TICK_TARGET_MS, TICK_MIN_CPUS, cpus);
+#endif
+
+    pGetThreadDescription = (GetThreadDescription_t)GetProcAddress(hKernel32, "GetThreadDescription");
+    pNtQueryInformationThread = (NtQueryInformationThread_t)GetProcAddress(hNtdll, "NtQueryInformationThread");
+    pSetThreadInformation = (SetThreadInformation_t)GetProcAddress(hKernel32, "SetThreadInformation");
+
+    // The thread won't start running until the loader lock is released
+    if ((hThread = CreateThread(NULL, 0, ServiceThreadProc, NULL, 0, &ServiceThreadId)) != NULL)
+        CloseHandle(hThread);
+    else
+        Log("StartServiceThread: CreateThread failed GLE=%u", GetLastError());
+}
+
+#if WHOLE_CORES
+// Drops the cores that the limit only partly covers. Logical processors of a core are numbered next to each other, so
+// only the last core can be split and the limit stays the low bits. Called from DllMain before anything is hooked, so
+// this asks the system directly; under Wine that is Wine's own answer, which lists cores even where it leaves out
+// caches, and keeps sysfs reads out of the loader lock.
+static void RoundToWholeCores()
+{
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION buf;
+    DWORD length = 0;
+    unsigned long long whole = 0;
+    unsigned count = 0;
+
+    if (GetLogicalProcessorInformation(NULL, &length) || GetLastError() != ERROR_INSUFFICIENT_BUFFER ||
+        !(buf = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)HeapAlloc(GetProcessHeap(), 0, length)))
+        return;
+    if (GetLogicalProcessorInformation(buf, &length))
+    {
+        for (DWORD i = 0; i < length / sizeof(*buf); ++i)
+        {
+            if (buf[i].Relationship == RelationProcessorCore && !(buf[i].ProcessorMask & ~kCpuMask))
+                whole |= buf[i].ProcessorMask;
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, buf);
+
+    if (!whole || whole == kCpuMask || (whole & (whole + 1)))
+    {
+        if (whole != kCpuMask)
+            Log("RoundToWholeCores: whole cores %llx don't make a usable limit; keeping %u CPUs", whole, kNumCpus);
+        return;
+    }
+    for (unsigned long long bits = whole; bits; bits &= bits - 1)
+        ++count;
+    Log("RoundToWholeCores: NUM_CPUS %u splits a core; limiting to %u", kNumCpus, count);
+    kNumCpus = count;
+    kCpuMask = whole;
+    kReportedCpus = min(count * REPORT_MULTIPLIER, 64u);
+    kReportedMask = kReportedCpus >= 64 ? ~0ull : (1ull << kReportedCpus) - 1;
+}
+#endif
+
+static void InstallDetours()
+{
+    LONG err;
+    HINSTANCE hKernel32;
+
+    Log("InstallDetours");
+    if ((err = DetourTransactionBegin()) != NO_ERROR)
+        Log("DetourTransactionBegin failed: %d", err);
+    hKernel32 = GetModuleHandleW(L"Kernel32.dll");
+    if (!hKernel32)
+    {
+        Log("Failed to find Kernel32.dll");
+        DetourTransactionAbort();
+        return;
+    }
+
+#define HOOK(fn, mod)                                                                                                  \
+    if (!(Orig##fn = (fn##_t)GetProcAddress(mod, #fn)))                                                                \
+        Log("Failed to find " #fn);                                                                                    \
+    if (Orig##fn && (err = DetourAttach((PVOID*)&Orig##fn, (void*)My##fn)) != NO_ERROR)                                \
+    Log("DetourAttach(" #fn ") failed: %d", err)
+
+    HOOK(GetSystemInfo, hKernel32);
+    HOOK(GetNativeSystemInfo, hKernel32);
+    HOOK(GetProcessAffinityMask, hKernel32);
+    HOOK(SetProcessAffinityMask, hKernel32);
+    HOOK(SetThreadAffinityMask, hKernel32);
+    HOOK(GetProcessGroupAffinity, hKernel32);
+    HOOK(GetThreadGroupAffinity, hKernel32);
+    HOOK(SetThreadGroupAffinity, hKernel32);
+    HOOK(SetThreadIdealProcessor, hKernel32);
+    HOOK(SetThreadIdealProcessorEx, hKernel32);
+    HOOK(GetLogicalProcessorInformation, hKernel32);
+    HOOK(GetLogicalProcessorInformationEx, hKernel32);
+    HOOK(GetActiveProcessorCount, hKernel32);
+    HOOK(GetMaximumProcessorCount, hKernel32);
+    HOOK(GetActiveProcessorGroupCount, hKernel32);
+    HOOK(GetMaximumProcessorGroupCount, hKernel32);
+    HOOK(GetNumaHighestNodeNumber, hKernel32);
+    HOOK(GetNumaNodeProcessorMask, hKernel32);
+    HOOK(GetNumaNodeProcessorMaskEx, hKernel32);
+    HOOK(CreateIoCompletionPort, hKernel32);
+#if LIMIT_MEMORY
+    HOOK(GlobalMemoryStatusEx, hKernel32);
+    HOOK(GetPhysicallyInstalledSystemMemory, hKernel32);
+#endif
+#if TUNE_SPIN_COUNTS
+    HOOK(InitializeCriticalSectionAndSpinCount, hKernel32);
+    HOOK(InitializeCriticalSectionEx, hKernel32);
+#endif
+#if WORK_STEALING_POOL
+    HOOK(QueueUserWorkItem, hKernel32);
+#endif
+#if FRAME_DETECTION
+    HOOK(Sleep, hKernel32);
+    HOOK(SleepEx, hKernel32);
+    HOOK(WaitForSingleObject, hKernel32);
+    HOOK(WaitForSingleObjectEx, hKernel32);
+    HOOK(WaitForMultipleObjects, hKernel32);
+    HOOK(WaitForMultipleObjectsEx, hKernel32);
+#endif
+
+    // LoadLibraryW/A and LoadLibraryExA all end up here
+    HOOK(LoadLibraryExW, hKernel32);
+
+    if ((err = DetourTransactionCommit()) != NO_ERROR)
+        Log("DetourTransactionCommit failed: %d", err);
+    installed = true;
+    HookCom();
+
+    if (OrigGetProcessAffinityMask)
+    {
+        DWORD_PTR processMask, systemMask;
+        if (OrigGetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+            EnforcedMask = (processMask & kCpuMask) ? (processMask & kCpuMask) : processMask;
+    }
+    Log("EnforcedMask=%zx", EnforcedMask);
+}
+
+static void RestoreDetours()
+{
+    Log("RestoreDetours installed=%s", installed ? "true" : "false");
+    if (!installed)
+        return;
+
+#define UNHOOK(fn)                                                                                                     \
+    if (Orig##fn)                                                                                                      \
+    DetourDetach((PVOID*)&Orig##fn, (void*)My##fn)
+
+    DetourTransactionBegin();
+
+    UNHOOK(GetSystemInfo);
+    UNHOOK(GetNativeSystemInfo);
+    UNHOOK(GetProcessAffinityMask);
+    UNHOOK(SetProcessAffinityMask);
+    UNHOOK(SetThreadAffinityMask);
+    UNHOOK(GetProcessGroupAffinity);
+    UNHOOK(GetThreadGroupAffinity);
+    UNHOOK(SetThreadGroupAffinity);
+    UNHOOK(SetThreadIdealProcessor);
+    UNHOOK(SetThreadIdealProcessorEx);
+    UNHOOK(GetLogicalProcessorInformation);
+    UNHOOK(GetLogicalProcessorInformationEx);
+    UNHOOK(GetActiveProcessorCount);
+    UNHOOK(GetMaximumProcessorCount);
+    UNHOOK(GetActiveProcessorGroupCount);
+    UNHOOK(GetMaximumProcessorGroupCount);
+    UNHOOK(GetNumaHighestNodeNumber);
+    UNHOOK(GetNumaNodeProcessorMask);
+    UNHOOK(GetNumaNodeProcessorMaskEx);
+    UNHOOK(CreateIoCompletionPort);
+#if LIMIT_MEMORY
+    UNHOOK(GlobalMemoryStatusEx);
+    UNHOOK(GetPhysicallyInstalledSystemMemory);
+#endif
+#if TUNE_SPIN_COUNTS
+    UNHOOK(InitializeCriticalSectionAndSpinCount);
+    UNHOOK(InitializeCriticalSectionEx);
+#endif
+#if WORK_STEALING_POOL
+    UNHOOK(QueueUserWorkItem);
+#endif
+#if FRAME_DETECTION
+    UNHOOK(Sleep);
+    UNHOOK(SleepEx);
+    UNHOOK(WaitForSingleObject);
+    UNHOOK(WaitForSingleObjectEx);
+    UNHOOK(WaitForMultipleObjects);
+    UNHOOK(WaitForMultipleObjectsEx);
+#endif
+    UNHOOK(CoCreateInstance);
+    UNHOOK(LoadLibraryExW);
+
+    DetourTransactionCommit();
+
+    RestoreVtables();
+
+    // Clean up cached logical processor info
+    AcquireSRWLockExclusive(&CPUInfoLock);
+    if (CachedCPUInfo)
+    {
+        HeapFree(GetProcessHeap(), 0, CachedCPUInfo);
+        CachedCPUInfo = NULL;
+        CachedCPUInfoCount = 0;
+    }
+    if (CachedCPUInfoEx)
+    {
+        HeapFree(GetProcessHeap(), 0, CachedCPUInfoEx);
+        CachedRelationship = (LOGICAL_PROCESSOR_RELATIONSHIP)-1;
+        CachedCPUInfoEx = NULL;
+        CachedCPUInfoExBytes = 0;
+    }
+    ReleaseSRWLockExclusive(&CPUInfoLock);
+
+    installed = false;
+}
+
+BOOL WINAPI DllMain(HINSTANCE hInst, DWORD dwReason, LPVOID reserved)
 {
     if (DetourIsHelperProcess())
         return TRUE;
@@ -733,11 +4290,44 @@ BOOL WINAPI DllMain(HINSTANCE hInst, DWORD dwReason, LPVOID reserved)
         GetModuleHandleExW(
             GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, (LPCWSTR)&DllMain, &out);
 
+        QueryPerformanceFrequency(&QpcFrequency);
+#if WHOLE_CORES
+        RoundToWholeCores();
+#endif
         InstallDetours();
+
+        if ((ThreadStateTls = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+            Log("TlsAlloc failed GLE=%u", GetLastError());
+        AttachCurrentThread();
+        AttachExistingThreads();
+#if JOBSERVER
+        InitJobserver();
+#endif
+        StartServiceThread();
+#if TUNE_SPIN_COUNTS
+        // On a thread pool thread, off the loader lock
+        if (!TrySubmitThreadpoolCallback(WarmSpinTopology, NULL, NULL))
+            Log("TrySubmitThreadpoolCallback(WarmSpinTopology) failed GLE=%u", GetLastError());
+#endif
+    }
+    else if (dwReason == DLL_THREAD_ATTACH)
+    {
+        AttachCurrentThread();
+    }
+    else if (dwReason == DLL_THREAD_DETACH)
+    {
+        DetachCurrentThread();
     }
     else if (dwReason == DLL_PROCESS_DETACH)
     {
         RestoreDetours();
+        FreeAllThreadStates();
+#if JOBSERVER
+        ReleaseJobserver();
+#endif
+#if METRICS
+        RemoveMetrics();
+#endif
     }
     return TRUE;
 }
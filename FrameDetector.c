@@ -0,0 +1,143 @@
+/**
+ * @file FrameDetector.c
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Heuristic frame-boundary detection from a thread's blocking waits
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "FrameDetector.h"
+
+#include <math.h>
+#include <string.h>
+
+// Waits shorter than this are spin-ish handoffs, not frame waits
+#define MIN_WAIT_SECONDS 0.0001
+// Frame rates outside of 500..4 fps are not frames
+#define MIN_PERIOD_SECONDS 0.002
+#define MAX_PERIOD_SECONDS 0.25
+
+// A wait must be at least this fraction of the average boundary wait to be a boundary candidate
+#define SIGNIFICANT_WAIT_FRACTION 0.25
+// And must end at least this fraction of a frame after the previous boundary
+#define MIN_BOUNDARY_FRACTION 0.4
+// And must be this many times the 95th percentile of the waits that were not boundaries
+#define SHORT_WAIT_MARGIN 1.5
+#define SHORT_WAIT_PERCENTILE 0.95
+// Once this many frames have passed without a boundary, each rejected wait lowers the bar by WAIT_ALPHA, so that the
+// detector follows boundary waits that shrink suddenly (e.g. when the load rises and less of the frame is left to wait)
+#define MISSED_BOUNDARY_PERIODS 2.0
+
+#define WAIT_ALPHA (1.0 / 8.0)
+#define PERIOD_ALPHA (1.0 / 16.0)
+
+// Frames needed, and maximum relative jitter, to call the cadence stable
+#define LOCK_MIN_FRAMES 16
+#define LOCK_MAX_JITTER 0.25
+
+void FrameDetector_Init(FrameDetector* fd, uint64_t frequency)
+{
+    memset(fd, 0, sizeof(*fd));
+    fd->frequency = (double)frequency;
+    fd->minWaitTicks = (uint64_t)(MIN_WAIT_SECONDS * fd->frequency);
+    fd->minPeriodTicks = (uint64_t)(MIN_PERIOD_SECONDS * fd->frequency);
+    fd->maxPeriodTicks = (uint64_t)(MAX_PERIOD_SECONDS * fd->frequency);
+}
+
+void FrameDetector_WaitBegin(FrameDetector* fd, uint64_t now)
+{
+    // Waits can nest when one hooked wait is implemented with another; only the outermost counts.
+    if (fd->waitDepth++ == 0)
+        fd->waitBegin = now;
+}
+
+// Stochastic estimate of a percentile of the waits that were not boundaries: steps up or down in proportion to the
+// estimate itself, so it settles where SHORT_WAIT_PERCENTILE of the waits fall below it
+static void UpdateShortWait(FrameDetector* fd, uint64_t duration)
+{
+    double step = fd->shortWait * WAIT_ALPHA;
+
+    if (fd->shortWait <= 0.0)
+        fd->shortWait = (double)duration;
+    else if ((double)duration > fd->shortWait)
+        fd->shortWait += step * SHORT_WAIT_PERCENTILE;
+    else
+        fd->shortWait -= step * (1.0 - SHORT_WAIT_PERCENTILE);
+}
+
+int FrameDetector_WaitEnd(FrameDetector* fd, uint64_t now)
+{
+    uint64_t duration, interval;
+    double delta;
+
+    if (fd->waitDepth == 0 || --fd->waitDepth != 0)
+        return 0;
+
+    duration = now - fd->waitBegin;
+    if (duration < fd->minWaitTicks)
+        return 0;
+
+    // Only boundaries feed the average that candidates are measured against: short waits inside the frame (fences,
+    // handoffs) usually outnumber the boundary wait and would otherwise drag the bar down until they pass it
+    if ((fd->avgWait > 0.0 && (double)duration < fd->avgWait * SIGNIFICANT_WAIT_FRACTION) ||
+        (double)duration < fd->shortWait * SHORT_WAIT_MARGIN)
+    {
+        if (fd->period > 0.0 && (double)(now - fd->lastBoundary) > fd->period * MISSED_BOUNDARY_PERIODS)
+            fd->avgWait *= 1.0 - WAIT_ALPHA;
+        UpdateShortWait(fd, duration);
+        return 0;
+    }
+
+    if (!fd->lastBoundary)
+    {
+        fd->avgWait = (double)duration;
+        fd->lastBoundary = now;
+        return 0;
+    }
+
+    interval = now - fd->lastBoundary;
+    if (interval < fd->minPeriodTicks || (fd->period > 0.0 && (double)interval < fd->period * MIN_BOUNDARY_FRACTION))
+    {
+        UpdateShortWait(fd, duration);
+        return 0;
+    }
+
+    fd->avgWait = fd->avgWait > 0.0 ? fd->avgWait + ((double)duration - fd->avgWait) * WAIT_ALPHA : (double)duration;
+    fd->lastBoundary = now;
+    fd->lastFrame = interval;
+    fd->lastBusy = interval > duration ? interval - duration : 0;
+    ++fd->frames;
+
+    // Hitches, loading screens and idle periods are still frames, but must not drag the cadence estimate around
+    if (interval > fd->maxPeriodTicks)
+        return 1;
+
+    if (fd->period <= 0.0)
+    {
+        fd->period = (double)interval;
+        return 1;
+    }
+    delta = (double)interval - fd->period;
+    fd->period += delta * PERIOD_ALPHA;
+    fd->variance = (1.0 - PERIOD_ALPHA) * (fd->variance + delta * delta * PERIOD_ALPHA);
+    return 1;
+}
+
+int FrameDetector_IsLocked(const FrameDetector* fd)
+{
+    return fd->frames >= LOCK_MIN_FRAMES && fd->period > 0.0 && sqrt(fd->variance) < fd->period * LOCK_MAX_JITTER;
+}
+
+void FrameDetector_GetStats(const FrameDetector* fd, FrameStats* stats)
+{
+    double msPerTick = fd->frequency > 0.0 ? 1000.0 / fd->frequency : 0.0;
+
+    stats->frames = fd->frames;
+    stats->lastMs = (double)fd->lastFrame * msPerTick;
+    stats->avgMs = fd->period * msPerTick;
+    stats->jitterMs = sqrt(fd->variance) * msPerTick;
+    stats->locked = FrameDetector_IsLocked(fd);
+}
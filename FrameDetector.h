@@ -0,0 +1,68 @@
+/**
+ * @file FrameDetector.h
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Heuristic frame-boundary detection from a thread's blocking waits
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A game's main or render thread blocks once per frame (present/vsync, a fence, or a frame limiter's Sleep) and is
+// busy the rest of the time. A FrameDetector is fed the begin/end timestamps of one thread's waits and treats the end
+// of each "significant" wait as a frame boundary, where significant means long compared to the thread's other waits
+// and to its recent boundary waits, and at least a good part of a frame after the previous boundary.
+//
+// A FrameDetector is only written by the thread it watches. It has no OS dependencies; timestamps are in arbitrary
+// ticks (e.g. QueryPerformanceCounter) and the tick frequency is given at init.
+typedef struct FrameDetector
+{
+    double frequency;      // Ticks per second
+    uint64_t minWaitTicks; // Shorter waits are ignored entirely
+    uint64_t minPeriodTicks;
+    uint64_t maxPeriodTicks;
+
+    uint64_t waitBegin;
+    uint32_t waitDepth;
+    uint64_t lastBoundary;
+    double avgWait;   // EWMA of boundary wait durations (ticks)
+    double shortWait; // High percentile of the other waits' durations (ticks)
+    double period;  // EWMA of frame times (ticks)
+    double variance;
+    uint64_t lastFrame; // Most recent frame time (ticks)
+    uint64_t lastBusy;  // lastFrame minus the boundary wait that ended it: the time the frame's work took (ticks)
+    uint64_t frames;
+} FrameDetector;
+
+typedef struct FrameStats
+{
+    uint64_t frames;
+    double lastMs;
+    double avgMs;
+    double jitterMs; // Standard deviation of frame times
+    int locked;      // Non-zero when the thread shows a stable frame cadence
+} FrameStats;
+
+void FrameDetector_Init(FrameDetector* fd, uint64_t frequency);
+
+void FrameDetector_WaitBegin(FrameDetector* fd, uint64_t now);
+
+// Returns non-zero if the wait that ended at `now` was detected as a frame boundary.
+int FrameDetector_WaitEnd(FrameDetector* fd, uint64_t now);
+
+int FrameDetector_IsLocked(const FrameDetector* fd);
+
+void FrameDetector_GetStats(const FrameDetector* fd, FrameStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
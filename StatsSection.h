@@ -0,0 +1,94 @@
+/**
+ * @file StatsSection.h
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Layout of the shared-memory section that a limited process publishes its state in
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Each limited process built with STATS_SECTION creates a named section, "Local\CpuLimiterStats_<pid>", and its service
+// thread rewrites it every `intervalMs` (STATS_INTERVAL_MS). Monitors (tools/CpuLimiterTop.c) map it read-only, so
+// watching a process costs it nothing.
+//
+// The writer brackets each update by incrementing `sequence`, so it is odd while an update is in progress. Readers copy
+// the section and retry if `sequence` was odd or changed during the copy.
+#define STATS_SECTION_NAME_FORMAT L"Local\\CpuLimiterStats_%u"
+#define STATS_SECTION_VERSION 4
+
+#define STATS_MAX_CPUS 64
+#define STATS_MAX_RULES 16
+#define STATS_MAX_THREADS 256
+#define STATS_MAX_POOLS 16
+#define STATS_LABEL_LENGTH 32
+#define STATS_MAX_FEATURES 4
+
+typedef struct StatsThread
+{
+    uint32_t threadId;
+    int32_t rule;           // Index into StatsSection.ruleLabels, or -1 if no rule matches
+    uint32_t idealCpu;      // Physical processor
+    uint32_t utilization;   // Per mille of one CPU over the last update interval
+    uint32_t lastCpu;       // Physical processor the thread last woke up on (migration damping), or UINT32_MAX
+    uint32_t migrationRate; // Processor changes per second
+    int32_t pinnedCpu;      // Processor that migration damping has pinned the thread to, or -1
+    uint32_t reserved;
+    uint64_t affinity;
+    uint16_t startModule[STATS_LABEL_LENGTH]; // UTF-16, NUL-terminated (truncated)
+} StatsThread;
+
+// Threads grouped by the rule they match, or else by start address (POOL_EFFICIENCY)
+typedef struct StatsPool
+{
+    uint16_t label[STATS_LABEL_LENGTH]; // UTF-16, NUL-terminated; "(other)" collects pools beyond STATS_MAX_POOLS
+    uint32_t threads;
+    uint32_t parallelism;     // Average running threads over the last update interval, in thousandths
+    uint32_t peakParallelism; // Highest parallelism seen, in thousandths
+    uint32_t efficiency;      // Per mille: parallelism over min(threads, enforced CPUs)
+    uint32_t waitShare;       // Per mille of the pool's thread time spent blocked in hooked waits
+} StatsPool;
+
+typedef struct StatsSection
+{
+    uint32_t version;
+    volatile uint32_t sequence;
+    uint32_t pid;
+    uint32_t intervalMs; // How often the section is updated
+    uint64_t updates;
+
+    uint32_t numCpus;      // NUM_CPUS
+    uint32_t reportedCpus; // What the process is told
+    uint64_t enforcedMask; // Physical processors that threads are placed on
+    uint8_t virtualToPhysical[STATS_MAX_CPUS]; // For each reported CPU, the physical processor it runs on
+
+    double frameAvgMs; // 0 if no frame cadence was found
+    double frameJitterMs;
+
+    uint32_t overheadPermille; // The limiter's own share of the process's CPU time (overhead governor)
+    // How far the overhead governor has degraded frame detection, housekeeping and throttling; 0 is full service, and
+    // frame detection is off at 1
+    uint8_t featureLevels[STATS_MAX_FEATURES];
+
+    uint32_t ruleCount;
+    uint16_t ruleLabels[STATS_MAX_RULES][STATS_LABEL_LENGTH];
+
+    uint32_t threadCount; // Threads beyond STATS_MAX_THREADS are left out
+    StatsThread threads[STATS_MAX_THREADS];
+
+    uint32_t poolCount;
+    StatsPool pools[STATS_MAX_POOLS];
+} StatsSection;
+
+#ifdef __cplusplus
+}
+#endif
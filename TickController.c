@@ -0,0 +1,104 @@
+/**
+ * @file TickController.c
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Feedback controller that sizes the CPU set to a tick-time target
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "TickController.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Control toward a bit under the target so that noise doesn't push the p99 over it
+#define SETPOINT_FRACTION 0.9
+// Errors within this (relative) band neither integrate nor move the output
+#define DEADBAND 0.05
+// Ticks needed after a change before the window reflects it
+#define MIN_FRESH_SAMPLES 32
+
+// Mostly integral: tick time goes as 1/cores, so proportional kicks overshoot badly at low core counts (see
+// tools/TickControllerSim.c)
+#define DEFAULT_KP 0.02
+#define DEFAULT_KI 0.15
+
+void TickController_Init(TickController* tc, double targetMs, uint32_t minCores, uint32_t maxCores)
+{
+    memset(tc, 0, sizeof(*tc));
+    tc->targetMs = targetMs;
+    tc->kp = DEFAULT_KP;
+    tc->ki = DEFAULT_KI;
+    tc->minCores = minCores ? minCores : 1;
+    tc->maxCores = maxCores > tc->minCores ? maxCores : tc->minCores;
+    tc->output = tc->integral = 1.0;
+    tc->cores = tc->maxCores;
+}
+
+void TickController_AddTick(TickController* tc, double ms)
+{
+    tc->samples[tc->next] = ms;
+    tc->next = (tc->next + 1) % TICK_CONTROLLER_WINDOW;
+    if (tc->count < TICK_CONTROLLER_WINDOW)
+        ++tc->count;
+    ++tc->fresh;
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double TickController_Percentile(const TickController* tc, double p)
+{
+    double sorted[TICK_CONTROLLER_WINDOW];
+    uint32_t index;
+
+    if (!tc->count)
+        return 0.0;
+    memcpy(sorted, tc->samples, tc->count * sizeof(double));
+    qsort(sorted, tc->count, sizeof(double), CompareDouble);
+    index = (uint32_t)ceil(p * tc->count);
+    return sorted[index ? index - 1 : 0];
+}
+
+uint32_t TickController_Update(TickController* tc)
+{
+    double setpoint = tc->targetMs * SETPOINT_FRACTION;
+    double error, output;
+    uint32_t span = tc->maxCores - tc->minCores;
+
+    if (tc->fresh < MIN_FRESH_SAMPLES || setpoint <= 0.0)
+        return tc->cores;
+    tc->fresh = 0;
+
+    // Only ticks run since the last change say anything about the current core count. Positive error (too slow) asks
+    // for more cores.
+    tc->lastP99 = TickController_Percentile(tc, 0.99);
+    tc->count = tc->next = 0;
+    error = (tc->lastP99 - setpoint) / setpoint;
+    if (fabs(error) < DEADBAND)
+        return tc->cores;
+
+    // Conditional integration: don't wind further into a limit the output is already pinned at
+    if (!((tc->output >= 1.0 && error > 0.0) || (tc->output <= 0.0 && error < 0.0)))
+        tc->integral += tc->ki * error;
+    tc->integral = fmin(fmax(tc->integral, 0.0), 1.0);
+
+    output = tc->integral + tc->kp * error;
+    tc->output = fmin(fmax(output, 0.0), 1.0);
+
+    // Only shrink by whole cores once the output clearly asks for it; grow as soon as it does
+    if (tc->output * span + tc->minCores > tc->cores)
+        tc->cores = tc->minCores + (uint32_t)ceil(tc->output * span);
+    else if (tc->output * span + tc->minCores < tc->cores - 1.0)
+        tc->cores = tc->minCores + (uint32_t)floor(tc->output * span + 0.5);
+    if (tc->cores > tc->maxCores)
+        tc->cores = tc->maxCores;
+    return tc->cores;
+}
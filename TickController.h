@@ -0,0 +1,60 @@
+/**
+ * @file TickController.h
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Feedback controller that sizes the CPU set to a tick-time target
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TICK_CONTROLLER_WINDOW 256
+
+// A dedicated server cares about its tick time staying under a target (an SLO on, say, the 99th percentile), not about
+// a fixed CPU count. A TickController is fed tick durations and periodically asked for a core count: a PI controller
+// on the normalized error between the window's p99 and the target drives the count between minCores and maxCores,
+// settling on the fewest cores that keep the p99 under the target. The integral stops accumulating while the output is
+// saturated (anti-windup), so a long stretch at maxCores doesn't delay giving cores back once the load drops.
+//
+// A TickController has no OS dependencies and is not thread-safe.
+typedef struct TickController
+{
+    double targetMs;
+    double kp, ki;
+    uint32_t minCores, maxCores;
+
+    double samples[TICK_CONTROLLER_WINDOW]; // Most recent tick times (ms), a ring
+    uint32_t count;                         // Valid samples, up to TICK_CONTROLLER_WINDOW
+    uint32_t next;
+    uint32_t fresh; // Samples added since the last update
+
+    double integral;
+    double output; // 0..1 across [minCores, maxCores]
+    uint32_t cores;
+    double lastP99;
+} TickController;
+
+// Starts at maxCores, so that the controller only ever has to find out how much it can give back.
+void TickController_Init(TickController* tc, double targetMs, uint32_t minCores, uint32_t maxCores);
+
+void TickController_AddTick(TickController* tc, double ms);
+
+// Returns the percentile `p` (0..1) of the samples in the window, or 0 if there are none.
+double TickController_Percentile(const TickController* tc, double p);
+
+// Runs one control step and returns the core count to use. Holds the current count until enough new ticks have come in
+// to say anything about the last change.
+uint32_t TickController_Update(TickController* tc);
+
+#ifdef __cplusplus
+}
+#endif
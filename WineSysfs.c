@@ -0,0 +1,89 @@
+/**
+ * @file WineSysfs.c
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Parsing of the Linux host's CPU topology from sysfs
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "WineSysfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t SysfsParseCpuList(const char* list, unsigned maxCpus)
+{
+    uint64_t mask = 0;
+
+    if (maxCpus > 64)
+        maxCpus = 64;
+    while (*list >= '0' && *list <= '9')
+    {
+        char* end;
+        unsigned long first = strtoul(list, &end, 10), last = first;
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+        for (; first <= last && first < maxCpus; ++first)
+            mask |= (uint64_t)1 << first;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return mask;
+}
+
+uint32_t SysfsParseNumber(const char* text)
+{
+    char* end;
+    uint32_t value = (uint32_t)strtoul(text, &end, 10);
+
+    if (*end == 'K')
+        value <<= 10;
+    else if (*end == 'M')
+        value <<= 20;
+    return value;
+}
+
+static uint32_t ReadNumber(const SysfsReader* reader, unsigned cpu, unsigned index, const char* name)
+{
+    char path[96], text[32];
+
+    snprintf(path, sizeof(path), "system/cpu/cpu%u/cache/index%u/%s", cpu, index, name);
+    return reader->read(reader->context, path, text, sizeof(text)) ? SysfsParseNumber(text) : 0;
+}
+
+unsigned SysfsReadCaches(const SysfsReader* reader, unsigned cpu, uint64_t online, unsigned maxCpus, SysfsCache* out)
+{
+    unsigned count = 0;
+    char path[96], text[256];
+
+    for (unsigned index = 0; index < SYSFS_MAX_CACHES; ++index)
+    {
+        uint64_t mask;
+        snprintf(path, sizeof(path), "system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+        if (!reader->read(reader->context, path, text, sizeof(text)))
+            break;
+        // Only the lowest CPU sharing it adds the entry
+        if (!(mask = SysfsParseCpuList(text, maxCpus) & online) || (mask & (0 - mask)) != (uint64_t)1 << cpu)
+            continue;
+
+        out[count].mask = mask;
+        out[count].level = (uint8_t)ReadNumber(reader, cpu, index, "level");
+        out[count].associativity = (uint8_t)ReadNumber(reader, cpu, index, "ways_of_associativity");
+        out[count].lineSize = (uint16_t)ReadNumber(reader, cpu, index, "coherency_line_size");
+        out[count].size = ReadNumber(reader, cpu, index, "size");
+        out[count].type = SysfsCacheUnified;
+        snprintf(path, sizeof(path), "system/cpu/cpu%u/cache/index%u/type", cpu, index);
+        if (reader->read(reader->context, path, text, sizeof(text)))
+        {
+            if (!strncmp(text, "Data", 4))
+                out[count].type = SysfsCacheData;
+            else if (!strncmp(text, "Instruction", 11))
+                out[count].type = SysfsCacheInstruction;
+        }
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,66 @@
+/**
+ * @file WineSysfs.h
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Parsing of the Linux host's CPU topology from sysfs
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reads the sysfs file at `path`, relative to /sys/devices and '/'-separated (e.g. "system/cpu/online"), into `buf` as
+// a NUL-terminated string. Returns 0 if the file can't be read or is empty. Under Wine the DLL reads through the Z:
+// drive; the tools read a captured tree from a directory.
+typedef int (*SysfsReadFn)(void* context, const char* path, char* buf, size_t size);
+
+typedef struct SysfsReader
+{
+    SysfsReadFn read;
+    void* context;
+} SysfsReader;
+
+// Same values as Windows' PROCESSOR_CACHE_TYPE
+typedef enum SysfsCacheType
+{
+    SysfsCacheUnified,
+    SysfsCacheInstruction,
+    SysfsCacheData,
+} SysfsCacheType;
+
+typedef struct SysfsCache
+{
+    uint64_t mask; // The CPUs sharing the cache
+    uint8_t level;
+    uint8_t associativity;
+    uint16_t lineSize;
+    uint32_t size; // In bytes
+    SysfsCacheType type;
+} SysfsCache;
+
+// Most caches listed per CPU (cache/index0 through index7)
+#define SYSFS_MAX_CACHES 8
+
+// Parses a CPU list such as "0-3,8-11" into a mask. CPUs at or above maxCpus (at most 64) are left out.
+uint64_t SysfsParseCpuList(const char* list, unsigned maxCpus);
+
+// Parses a number such as "64" or a size such as "48K" or "32M"; sizes come out in bytes. Returns 0 if there is none.
+uint32_t SysfsParseNumber(const char* text);
+
+// Fills `out` with the caches of `cpu` that `cpu` is the lowest-numbered CPU in `online` of, so that walking every CPU
+// lists each cache once. The masks are limited to `online` and to maxCpus. Returns the number of entries filled, at
+// most SYSFS_MAX_CACHES.
+unsigned SysfsReadCaches(const SysfsReader* reader, unsigned cpu, uint64_t online, unsigned maxCpus, SysfsCache* out);
+
+#ifdef __cplusplus
+}
+#endif
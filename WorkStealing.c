@@ -0,0 +1,145 @@
+/**
+ * @file WorkStealing.c
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Lock-free work-stealing deque and cache-aware steal order
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "WorkStealing.h"
+
+#include <stdlib.h>
+
+// Just the atomics that the deque needs. MSVC targets here are x86/x64, where plain aligned loads/stores already have
+// acquire/release semantics and only the compiler needs restraining.
+#if defined _MSC_VER
+#    include <intrin.h>
+#    define LOAD_RELAXED(p) (*(p))
+#    define LOAD_ACQUIRE(p) (_ReadWriteBarrier(), *(p))
+#    define STORE_RELAXED(p, v) (*(p) = (v))
+#    define FENCE_RELEASE() _ReadWriteBarrier()
+#    define FENCE_SEQ_CST() __faststorefence()
+#    define CAS_SEQ_CST(p, expected, desired)                                                                          \
+        (_InterlockedCompareExchange64((volatile __int64*)(p), (desired), (expected)) == (expected))
+#else
+#    define LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#    define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#    define STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#    define FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#    define FENCE_SEQ_CST() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#    define CAS_SEQ_CST(p, expected, desired)                                                                          \
+        __extension__({                                                                                                \
+            int64_t e_ = (expected);                                                                                   \
+            __atomic_compare_exchange_n((p), &e_, (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);                   \
+        })
+#endif
+
+int WsDeque_Init(WsDeque* dq, size_t capacity)
+{
+    dq->top = 0;
+    dq->bottom = 0;
+    dq->mask = (int64_t)capacity - 1;
+    dq->buffer = (void* volatile*)calloc(capacity, sizeof(void*));
+    return dq->buffer != NULL;
+}
+
+void WsDeque_Destroy(WsDeque* dq)
+{
+    free((void*)dq->buffer);
+    dq->buffer = NULL;
+}
+
+int WsDeque_Push(WsDeque* dq, void* item)
+{
+    int64_t b = LOAD_RELAXED(&dq->bottom);
+    int64_t t = LOAD_ACQUIRE(&dq->top);
+
+    if (b - t > dq->mask)
+        return 0;
+
+    STORE_RELAXED(&dq->buffer[b & dq->mask], item);
+    FENCE_RELEASE();
+    STORE_RELAXED(&dq->bottom, b + 1);
+    return 1;
+}
+
+void* WsDeque_Pop(WsDeque* dq)
+{
+    int64_t b = LOAD_RELAXED(&dq->bottom) - 1;
+    int64_t t;
+    void* item;
+
+    STORE_RELAXED(&dq->bottom, b);
+    FENCE_SEQ_CST();
+    t = LOAD_RELAXED(&dq->top);
+
+    if (t > b)
+    {
+        // Empty
+        STORE_RELAXED(&dq->bottom, b + 1);
+        return NULL;
+    }
+
+    item = LOAD_RELAXED(&dq->buffer[b & dq->mask]);
+    if (t == b)
+    {
+        // Last item; race the thieves for it
+        if (!CAS_SEQ_CST(&dq->top, t, t + 1))
+            item = NULL;
+        STORE_RELAXED(&dq->bottom, b + 1);
+    }
+    return item;
+}
+
+WsStealResult WsDeque_Steal(WsDeque* dq, void** item)
+{
+    int64_t t = LOAD_ACQUIRE(&dq->top);
+    int64_t b;
+    void* top;
+
+    FENCE_SEQ_CST();
+    b = LOAD_ACQUIRE(&dq->bottom);
+    if (t >= b)
+        return WsStealEmpty;
+
+    top = LOAD_RELAXED(&dq->buffer[t & dq->mask]);
+    if (!CAS_SEQ_CST(&dq->top, t, t + 1))
+        return WsStealAbort;
+    *item = top;
+    return WsStealSuccess;
+}
+
+void WsBuildStealOrder(const unsigned* domainOfWorker, unsigned workers, unsigned self, unsigned* order)
+{
+    unsigned n = 0;
+
+    // Same domain first
+    for (unsigned i = 1; i < workers; ++i)
+    {
+        unsigned victim = (self + i) % workers;
+        if (domainOfWorker[victim] == domainOfWorker[self])
+            order[n++] = victim;
+    }
+
+    // Then the remaining domains, one whole domain at a time, in the order we come across them
+    for (unsigned i = 1; i < workers && n < workers - 1; ++i)
+    {
+        unsigned domain = domainOfWorker[(self + i) % workers];
+        int seen = domain == domainOfWorker[self];
+
+        for (unsigned j = 1; j < i && !seen; ++j)
+            seen = domainOfWorker[(self + j) % workers] == domain;
+        if (seen)
+            continue;
+
+        for (unsigned j = i; j < workers; ++j)
+        {
+            unsigned victim = (self + j) % workers;
+            if (domainOfWorker[victim] == domain)
+                order[n++] = victim;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * @file WorkStealing.h
+ * @author Joshua Kriegshauser (https://github.com/jkriegshauser)
+ * @brief Lock-free work-stealing deque and cache-aware steal order
+ * @version 1.0
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fixed-capacity Chase-Lev deque (Le, Pop, Cohen & Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak Memory
+// Models", PPoPP 2013). The owning worker pushes and pops at the bottom; any other thread may steal from the top.
+// Items are opaque non-NULL pointers.
+typedef struct WsDeque
+{
+    volatile int64_t top;
+    char pad0[64 - sizeof(int64_t)]; // Keep thieves' and owner's hot fields on separate cache lines
+    volatile int64_t bottom;
+    char pad1[64 - sizeof(int64_t)];
+    void* volatile* buffer;
+    int64_t mask;
+} WsDeque;
+
+// capacity must be a power of two. Returns 0 on allocation failure.
+int WsDeque_Init(WsDeque* dq, size_t capacity);
+void WsDeque_Destroy(WsDeque* dq);
+
+// Owner only. Returns 0 if the deque is full.
+int WsDeque_Push(WsDeque* dq, void* item);
+
+// Owner only. Returns NULL if the deque is empty.
+void* WsDeque_Pop(WsDeque* dq);
+
+typedef enum WsStealResult
+{
+    WsStealEmpty,
+    WsStealSuccess,
+    WsStealAbort, // Another thread won the race for the top item; the deque may still hold more, so try again
+} WsStealResult;
+
+// Any thread. Sets *item only on WsStealSuccess.
+WsStealResult WsDeque_Steal(WsDeque* dq, void** item);
+
+// Fills `order` (workers - 1 entries) with the victims that worker `self` should try to steal from: first the workers
+// that share its cache domain (e.g. L3), then the other domains, each starting just after `self` so that thieves spread
+// out instead of all hammering worker 0.
+void WsBuildStealOrder(const unsigned* domainOfWorker, unsigned workers, unsigned self, unsigned* order);
+
+#ifdef __cplusplus
+}
+#endif
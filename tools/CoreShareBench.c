@@ -0,0 +1,161 @@
+/**
+ * @file CoreShareBench.c
+ * @brief Measures how much a co-runner on the other processors slows the limited process's threads
+ *
+ * Starts a co-runner: a copy of itself that keeps every processor outside the limited set busy. It then runs one
+ * spinning thread per processor it was given and prints each thread's rate, the average per thread and the slowest
+ * thread as a share of the fastest. A processor whose core is split by the limit shares that core with a co-runner
+ * thread, so whichever of our threads runs there falls behind. Run under CpuLimiter with NUM_CPUS set to an odd count
+ * on an SMT machine, built with and without WHOLE_CORES, and with a co-runner mask of 0 for a baseline. With
+ * WHOLE_CORES the average per thread should stay close to the baseline; without it, it drops.
+ *
+ * The co-runner's processors default to all of the machine's outside the process affinity. That is what CpuLimiter
+ * reports, so leave REPORT_MULTIPLIER at 1 or pass the mask.
+ *
+ * Unlike the portable tools this one needs Windows. Build with e.g. `cl /O2 tools\CoreShareBench.c`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 64
+
+typedef struct Worker
+{
+    volatile LONG* stop;
+    volatile unsigned long long iterations;
+} Worker;
+
+static unsigned long long Burn(unsigned iterations)
+{
+    volatile unsigned long long x = 0;
+    for (unsigned i = 0; i < iterations; ++i)
+        x += i * 2654435761u;
+    return x;
+}
+
+static DWORD WINAPI WorkerProc(LPVOID param)
+{
+    Worker* w = (Worker*)param;
+
+    while (!*w->stop)
+    {
+        Burn(10000);
+        ++w->iterations;
+    }
+    return 0;
+}
+
+// Runs the workers for `milliseconds`; each is pinned to one processor of `mask` if it is non-zero
+static void RunWorkers(Worker* workers, unsigned count, DWORD_PTR mask, unsigned milliseconds)
+{
+    static HANDLE threads[MAX_THREADS];
+    volatile LONG stop = 0;
+    DWORD_PTR bits = mask;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        workers[i].stop = &stop;
+        workers[i].iterations = 0;
+        threads[i] = CreateThread(NULL, 0, WorkerProc, &workers[i], CREATE_SUSPENDED, NULL);
+        if (bits)
+        {
+            SetThreadAffinityMask(threads[i], bits & (~bits + 1));
+            bits &= bits - 1;
+        }
+    }
+    for (unsigned i = 0; i < count; ++i)
+        ResumeThread(threads[i]);
+    Sleep(milliseconds);
+    stop = 1;
+    WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+    for (unsigned i = 0; i < count; ++i)
+        CloseHandle(threads[i]);
+}
+
+static unsigned CountBits(DWORD_PTR mask)
+{
+    unsigned count = 0;
+    for (; mask; mask &= mask - 1)
+        ++count;
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    static Worker workers[MAX_THREADS];
+    DWORD_PTR processMask, systemMask, corunMask;
+    unsigned count, milliseconds;
+    unsigned long long slowest = ~0ull, fastest = 0, total = 0;
+    PROCESS_INFORMATION pi = { 0 };
+
+    // The co-runner: keep every processor we were given busy for the given time
+    if (argc == 3 && !strcmp(argv[1], "--corun"))
+    {
+        GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+        RunWorkers(workers, min(CountBits(processMask), MAX_THREADS), processMask, atoi(argv[2]));
+        return 0;
+    }
+
+    GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+    count = argc > 1 && atoi(argv[1]) ? atoi(argv[1]) : CountBits(processMask);
+    milliseconds = argc > 2 ? atoi(argv[2]) : 3000;
+    corunMask = argc > 3 ? (DWORD_PTR)_strtoui64(argv[3], NULL, 16) : systemMask & ~processMask;
+    if (!count || count > MAX_THREADS || argc > 4)
+    {
+        fprintf(stderr, "Usage: CoreShareBench [threads, 0 for one per processor] [milliseconds] "
+                        "[co-runner mask (hex), 0 for none]\n");
+        return 2;
+    }
+    printf("%u threads on %zx, co-runner on %zx\n", count, processMask, corunMask);
+
+    if (corunMask)
+    {
+        char path[MAX_PATH], command[MAX_PATH + 32];
+        STARTUPINFOA si = { sizeof(si) };
+
+        // Started suspended so that it only runs on its own processors. It outlasts the measurement so that it
+        // is busy for all of it.
+        GetModuleFileNameA(NULL, path, sizeof(path));
+        snprintf(command, sizeof(command), "\"%s\" --corun %u", path, milliseconds + 1000);
+        if (!CreateProcessA(path, command, NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &si, &pi) ||
+            !SetProcessAffinityMask(pi.hProcess, corunMask))
+        {
+            fprintf(stderr, "Starting the co-runner failed: %lu\n", GetLastError());
+            if (pi.hProcess)
+                TerminateProcess(pi.hProcess, 1);
+            return 1;
+        }
+        ResumeThread(pi.hThread);
+        Sleep(500);
+    }
+
+    // Not pinned: CpuLimiter places them
+    RunWorkers(workers, count, 0, milliseconds);
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        double rate = workers[i].iterations * 1000.0 / milliseconds;
+        printf("thread %2u: %10.0f iterations/s\n", i, rate);
+        slowest = min(slowest, workers[i].iterations);
+        fastest = max(fastest, workers[i].iterations);
+        total += workers[i].iterations;
+    }
+    printf("total %.0f iterations/s, %.0f per thread, slowest thread at %.1f%% of the fastest\n",
+           total * 1000.0 / milliseconds, total * 1000.0 / milliseconds / count,
+           fastest ? 100.0 * slowest / fastest : 0.0);
+
+    if (pi.hProcess)
+    {
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file CpuLimiterTop.c
+ * @brief Live console monitor for every process running CpuLimiter
+ *
+ * Finds limited processes by their shared-memory stats section (see StatsSection.h), maps each one read-only and shows
+ * its virtual-to-physical CPU map, enforced CPUs, frame cadence, the limiter's own overhead and whatever the overhead
+ * governor has turned down, per-thread class, ideal and last CPU (marked * when pinned by migration damping),
+ * utilization, migrations and affinity, and the parallelism and efficiency of each pool of threads. Reading a section
+ * doesn't involve the target process at all. Only DLLs built with STATS_SECTION set to 1 publish a section; they update
+ * it every STATS_INTERVAL_MS (100 ms by default), which is also the shortest refresh.
+ *
+ * Unlike the other tools this one needs Windows. Build with e.g. `cl /O2 /I. tools\CpuLimiterTop.c`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <windows.h>
+#include <tlhelp32.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "StatsSection.h"
+
+#define MIN_INTERVAL_MS 100
+
+static StatsSection Snapshot;
+
+// Copies a consistent snapshot of a section that its process may be updating. Returns 0 if none could be had.
+static int ReadSection(const volatile StatsSection* shared, StatsSection* out)
+{
+    for (int tries = 0; tries < 10; ++tries, Sleep(1))
+    {
+        uint32_t sequence = shared->sequence;
+        if (sequence & 1)
+            continue;
+        MemoryBarrier();
+        memcpy(out, (const void*)shared, sizeof(*out));
+        MemoryBarrier();
+        if (shared->sequence == sequence)
+            return out->version == STATS_SECTION_VERSION;
+    }
+    return 0;
+}
+
+static void PrintMask(uint64_t mask)
+{
+    int first = 1;
+
+    for (int cpu = 0; cpu < 64; ++cpu)
+    {
+        int end = cpu;
+        if (!(mask & (1ull << cpu)))
+            continue;
+        while (end < 63 && (mask & (1ull << (end + 1))))
+            ++end;
+        printf(end > cpu ? "%s%d-%d" : "%s%d", first ? "" : ",", cpu, end);
+        first = 0;
+        cpu = end;
+    }
+    if (first)
+        printf("-");
+}
+
+static void PrintProcess(const PROCESSENTRY32W* pe, const StatsSection* s)
+{
+    printf("\n%5u %-24ls CPUs %u (reported %u) enforced ", s->pid, pe->szExeFile, s->numCpus, s->reportedCpus);
+    PrintMask(s->enforcedMask);
+    if (s->frameAvgMs > 0.0)
+        printf("  frame %.2f ms +/- %.2f", s->frameAvgMs, s->frameJitterMs);
+    if (s->overheadPermille)
+        printf("  overhead %.1f%%", s->overheadPermille / 10.0);
+    // Steps the overhead governor has taken
+    if (s->featureLevels[0])
+        printf(" frames off");
+    if (s->featureLevels[1])
+        printf(" rules every %u s", 1u << s->featureLevels[1]);
+    if (s->featureLevels[2])
+        printf(" throttle steps x%u", 1u << s->featureLevels[2]);
+    printf("\n      vCPU->CPU:");
+    for (uint32_t v = 0; v < s->reportedCpus && v < STATS_MAX_CPUS; ++v)
+        printf(" %u->%u", v, s->virtualToPhysical[v]);
+
+    if (s->poolCount)
+        printf("\n  %-32s %7s %8s %8s %6s %6s", "POOL", "THREADS", "PARALLEL", "PEAK", "EFF%", "WAIT%");
+    for (uint32_t i = 0; i < s->poolCount && i < STATS_MAX_POOLS; ++i)
+    {
+        const StatsPool* p = &s->pools[i];
+        printf("\n  %-32.*ls %7u %8.2f %8.2f %6.1f %6.1f", STATS_LABEL_LENGTH, (const wchar_t*)p->label, p->threads,
+               p->parallelism / 1000.0, p->peakParallelism / 1000.0, p->efficiency / 10.0, p->waitShare / 10.0);
+    }
+    printf("\n  %8s %-24s %5s %5s %7s %6s %-12s %s\n", "TID", "CLASS", "IDEAL", "CPU", "UTIL%", "MIG/s", "AFFINITY",
+           "MODULE");
+
+    for (uint32_t i = 0; i < s->threadCount && i < STATS_MAX_THREADS; ++i)
+    {
+        const StatsThread* t = &s->threads[i];
+        const wchar_t* label = t->rule >= 0 && (uint32_t)t->rule < s->ruleCount ? (const wchar_t*)s->ruleLabels[t->rule]
+                                                                                 : L"-";
+        char lastCpu[16] = "-";
+        if (t->lastCpu != UINT32_MAX)
+            snprintf(lastCpu, sizeof(lastCpu), "%u", t->lastCpu);
+        printf("  %8u %-24.24ls %5u %4s%c %7.1f %6u ", t->threadId, label, t->idealCpu, lastCpu,
+               t->pinnedCpu >= 0 ? '*' : ' ', t->utilization / 10.0, t->migrationRate);
+        PrintMask(t->affinity);
+        printf("\t%.*ls\n", STATS_LABEL_LENGTH, (const wchar_t*)t->startModule);
+    }
+}
+
+// Shows every limited process (or just `pid`). Returns the number shown.
+static unsigned Refresh(DWORD pid)
+{
+    PROCESSENTRY32W pe = { sizeof(pe) };
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    unsigned shown = 0;
+
+    if (hSnapshot == INVALID_HANDLE_VALUE)
+        return 0;
+    for (BOOL more = Process32FirstW(hSnapshot, &pe); more; more = Process32NextW(hSnapshot, &pe))
+    {
+        WCHAR name[64];
+        HANDLE hMapping;
+        const StatsSection* shared;
+
+        if (pid && pe.th32ProcessID != pid)
+            continue;
+        swprintf_s(name, _countof(name), STATS_SECTION_NAME_FORMAT, pe.th32ProcessID);
+        if (!(hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name)))
+            continue;
+        if ((shared = (const StatsSection*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, sizeof(StatsSection))) != NULL)
+        {
+            if (ReadSection(shared, &Snapshot))
+            {
+                PrintProcess(&pe, &Snapshot);
+                ++shown;
+            }
+            UnmapViewOfFile(shared);
+        }
+        CloseHandle(hMapping);
+    }
+    CloseHandle(hSnapshot);
+    return shown;
+}
+
+int main(int argc, char** argv)
+{
+    HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode, pid = 0, interval = 1000;
+    int once = 0;
+
+    for (; argc > 1; --argc, ++argv)
+    {
+        if (!strcmp(argv[1], "-1"))
+            once = 1;
+        else if (!strcmp(argv[1], "-i") && argc > 2)
+            interval = max((DWORD)atoi(argv[2]), MIN_INTERVAL_MS), --argc, ++argv;
+        else if (!strcmp(argv[1], "-p") && argc > 2)
+            pid = (DWORD)atoi(argv[2]), --argc, ++argv;
+        else
+        {
+            fprintf(stderr, "Usage: CpuLimiterTop [-1] [-i interval_ms] [-p pid]\n");
+            return 2;
+        }
+    }
+
+    // Redraw in place with VT sequences where the console supports them
+    if (!once && GetConsoleMode(hOut, &mode))
+        SetConsoleMode(hOut, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    for (;;)
+    {
+        unsigned shown;
+
+        if (!once)
+            printf("\x1b[H\x1b[J");
+        printf("CpuLimiterTop (every %u ms)\n", interval);
+        shown = Refresh(pid);
+        if (!shown)
+            printf("\nNo limited processes found\n");
+        fflush(stdout);
+        if (once)
+            return shown ? 0 : 1;
+        Sleep(interval);
+    }
+}
@@ -0,0 +1,465 @@
+/**
+ * @file FrameCompare.c
+ * @brief Compares frame-time logs from two or more CpuLimiter configurations
+ *
+ * Each input file is one configuration. For every configuration the p50/p95/p99/p99.9 frame times are reported with
+ * bootstrap confidence intervals, and every pair of configurations is compared with a Mann-Whitney U test so that a
+ * difference in the tail can be told apart from noise.
+ *
+ * Accepted inputs are PresentMon-style CSV (OCAT, CapFrameX exports, etc.; the frame time column is found by name) and
+ * plain text with one frame time in milliseconds per line.
+ *
+ * Portable C99; build with e.g. `cc -O2 -o FrameCompare tools/FrameCompare.c -lm` (or `cl /O2 tools\FrameCompare.c`).
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#    define strcasecmp _stricmp
+#else
+#    include <strings.h>
+#endif
+
+#define MAX_LINE 65536
+
+static const double kPercentiles[] = { 50.0, 95.0, 99.0, 99.9 };
+#define NUM_PERCENTILES (sizeof(kPercentiles) / sizeof(kPercentiles[0]))
+
+// Frame time columns that we know about, in order of preference
+static const char* kColumnNames[] = { "MsBetweenPresents", "FrameTime", "MsBetweenDisplayChange", "msBetweenPresents",
+                                      "frametime", "frame_time_ms" };
+
+typedef struct Series
+{
+    const char* label;
+    double* values; // Sorted ascending after loading
+    size_t count;
+    double mean;
+    double pct[NUM_PERCENTILES];
+    double lo[NUM_PERCENTILES]; // Bootstrap confidence interval
+    double hi[NUM_PERCENTILES];
+} Series;
+
+typedef struct Options
+{
+    unsigned bootstrap;
+    double confidence;
+    uint64_t seed;
+    const char* column;
+} Options;
+
+// splitmix64; small, fast and reproducible across platforms
+static uint64_t NextRandom(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static size_t RandomIndex(uint64_t* state, size_t n)
+{
+    // Multiply-shift is unbiased enough for resampling and avoids a division
+    return (size_t)(((NextRandom(state) >> 32) * (uint64_t)n) >> 32);
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Linear interpolation between closest ranks (Hyndman & Fan type 7) on sorted data
+static double Percentile(const double* sorted, size_t n, double p)
+{
+    double rank = p / 100.0 * (double)(n - 1);
+    size_t i = (size_t)rank;
+    double frac = rank - (double)i;
+
+    if (i + 1 >= n)
+        return sorted[n - 1];
+    return sorted[i] + (sorted[i + 1] - sorted[i]) * frac;
+}
+
+// Same as Percentile() but for a resample described by per-element counts of the sorted data. This avoids sorting every
+// bootstrap resample: one pass over the counts finds every requested rank.
+static void PercentilesFromCounts(const double* sorted,
+                                  const unsigned* counts,
+                                  size_t n,
+                                  double* out)
+{
+    size_t cumulative = 0, src = 0;
+
+    for (size_t p = 0; p < NUM_PERCENTILES; ++p)
+    {
+        double rank = kPercentiles[p] / 100.0 * (double)(n - 1);
+        size_t i = (size_t)rank;
+        double frac = rank - (double)i, a, b;
+
+        // Find the element holding resample rank i, then the one holding i + 1
+        while (cumulative + counts[src] <= i)
+            cumulative += counts[src++];
+        a = sorted[src];
+        if (i + 1 >= n)
+        {
+            out[p] = a;
+            continue;
+        }
+        if (cumulative + counts[src] > i + 1)
+            b = a;
+        else
+        {
+            size_t next = src + 1;
+            while (!counts[next])
+                ++next;
+            b = sorted[next];
+        }
+        out[p] = a + (b - a) * frac;
+    }
+}
+
+static void Bootstrap(Series* s, const Options* opt)
+{
+    unsigned* counts = (unsigned*)malloc(s->count * sizeof(unsigned));
+    double* samples = (double*)malloc((size_t)opt->bootstrap * NUM_PERCENTILES * sizeof(double));
+    double* column = (double*)malloc(opt->bootstrap * sizeof(double));
+    uint64_t state = opt->seed;
+    double alpha = (1.0 - opt->confidence) / 2.0 * 100.0;
+
+    if (!counts || !samples || !column)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned b = 0; b < opt->bootstrap; ++b)
+    {
+        memset(counts, 0, s->count * sizeof(unsigned));
+        for (size_t i = 0; i < s->count; ++i)
+            ++counts[RandomIndex(&state, s->count)];
+        PercentilesFromCounts(s->values, counts, s->count, &samples[b * NUM_PERCENTILES]);
+    }
+
+    for (size_t p = 0; p < NUM_PERCENTILES; ++p)
+    {
+        for (unsigned b = 0; b < opt->bootstrap; ++b)
+            column[b] = samples[b * NUM_PERCENTILES + p];
+        qsort(column, opt->bootstrap, sizeof(double), CompareDouble);
+        s->lo[p] = Percentile(column, opt->bootstrap, alpha);
+        s->hi[p] = Percentile(column, opt->bootstrap, 100.0 - alpha);
+    }
+
+    free(column);
+    free(samples);
+    free(counts);
+}
+
+static int AppendValue(Series* s, size_t* capacity, double v)
+{
+    if (s->count == *capacity)
+    {
+        size_t newCapacity = *capacity ? *capacity * 2 : 4096;
+        double* p = (double*)realloc(s->values, newCapacity * sizeof(double));
+        if (!p)
+            return 0;
+        s->values = p;
+        *capacity = newCapacity;
+    }
+    s->values[s->count++] = v;
+    return 1;
+}
+
+static char* Trim(char* str)
+{
+    char* end;
+    while (isspace((unsigned char)*str) || *str == '"')
+        ++str;
+    end = str + strlen(str);
+    while (end > str && (isspace((unsigned char)end[-1]) || end[-1] == '"'))
+        *--end = '\0';
+    return str;
+}
+
+// Splits a CSV line in place. Quoted commas are not supported (PresentMon never emits them).
+static size_t SplitFields(char* line, char** fields, size_t maxFields)
+{
+    size_t n = 0;
+    char* p = line;
+
+    while (n < maxFields)
+    {
+        char* comma = strchr(p, ',');
+        if (comma)
+            *comma = '\0';
+        fields[n++] = Trim(p);
+        if (!comma)
+            break;
+        p = comma + 1;
+    }
+    return n;
+}
+
+static int ParseNumber(const char* str, double* out)
+{
+    char* end;
+    errno = 0;
+    *out = strtod(str, &end);
+    return end != str && *Trim(end) == '\0' && errno == 0;
+}
+
+static int LoadSeries(Series* s, const char* path, const Options* opt)
+{
+    static char line[MAX_LINE];
+    char* fields[256];
+    FILE* f = fopen(path, "r");
+    size_t capacity = 0, skipped = 0;
+    long column = -1; // -1 = not determined yet; otherwise column index (0 for plain lists)
+
+    if (!f)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        size_t n;
+        double v;
+
+        if (line[0] == '#' || *Trim(line) == '\0')
+            continue;
+
+        n = SplitFields(line, fields, sizeof(fields) / sizeof(fields[0]));
+        if (column < 0)
+        {
+            if (n == 1 || ParseNumber(fields[0], &v))
+            {
+                // No header; take the first field of each line
+                column = 0;
+            }
+            else
+            {
+                for (size_t c = 0; column < 0 && c < sizeof(kColumnNames) / sizeof(kColumnNames[0]); ++c)
+                {
+                    const char* want = opt->column ? opt->column : kColumnNames[c];
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        if (!strcasecmp(fields[i], want))
+                        {
+                            column = (long)i;
+                            break;
+                        }
+                    }
+                    if (opt->column)
+                        break;
+                }
+                if (column < 0)
+                {
+                    fprintf(stderr, "%s: no frame time column found in header\n", path);
+                    fclose(f);
+                    return 0;
+                }
+                continue;
+            }
+        }
+
+        if ((size_t)column >= n || !ParseNumber(fields[column], &v) || !(v > 0.0))
+        {
+            ++skipped;
+            continue;
+        }
+        if (!AppendValue(s, &capacity, v))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    fclose(f);
+
+    if (skipped)
+        fprintf(stderr, "%s: skipped %zu unparseable rows\n", path, skipped);
+    if (s->count < 2)
+    {
+        fprintf(stderr, "%s: need at least two frame times, found %zu\n", path, s->count);
+        return 0;
+    }
+    return 1;
+}
+
+static void Summarize(Series* s, const Options* opt)
+{
+    double sum = 0.0;
+
+    qsort(s->values, s->count, sizeof(double), CompareDouble);
+    for (size_t i = 0; i < s->count; ++i)
+        sum += s->values[i];
+    s->mean = sum / (double)s->count;
+    for (size_t p = 0; p < NUM_PERCENTILES; ++p)
+        s->pct[p] = Percentile(s->values, s->count, kPercentiles[p]);
+    if (opt->bootstrap)
+        Bootstrap(s, opt);
+}
+
+// Two-sided Mann-Whitney U test with tie correction and the normal approximation (frame logs are always large enough).
+// Both series must be sorted. Returns the p-value; *effect receives the rank-biserial correlation (positive when
+// `b` tends to have longer frame times than `a`).
+static double MannWhitney(const Series* a, const Series* b, double* effect)
+{
+    double n1 = (double)a->count, n2 = (double)b->count, n = n1 + n2;
+    double rankSumA = 0.0, tieTerm = 0.0, u, mean, sigma, z;
+    size_t i = 0, j = 0, rank = 1;
+
+    // Merge the two sorted series, assigning average ranks to runs of equal values
+    while (i < a->count || j < b->count)
+    {
+        double v = (j >= b->count || (i < a->count && a->values[i] <= b->values[j])) ? a->values[i] : b->values[j];
+        size_t inA = 0, inB = 0;
+        double t, avgRank;
+
+        while (i < a->count && a->values[i] == v)
+            ++i, ++inA;
+        while (j < b->count && b->values[j] == v)
+            ++j, ++inB;
+
+        t = (double)(inA + inB);
+        avgRank = (double)rank + (t - 1.0) / 2.0;
+        rankSumA += avgRank * (double)inA;
+        tieTerm += t * t * t - t;
+        rank += inA + inB;
+    }
+
+    u = rankSumA - n1 * (n1 + 1.0) / 2.0;
+    mean = n1 * n2 / 2.0;
+    sigma = sqrt(n1 * n2 / 12.0 * ((n + 1.0) - tieTerm / (n * (n - 1.0))));
+    *effect = 1.0 - 2.0 * u / (n1 * n2);
+    if (sigma == 0.0)
+        return 1.0;
+
+    // Continuity correction
+    z = (fabs(u - mean) - 0.5) / sigma;
+    if (z < 0.0)
+        z = 0.0;
+    return erfc(z / sqrt(2.0));
+}
+
+static void Usage(const char* argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [label=]file [label=]file ...\n"
+            "  -b N       bootstrap resamples (default 2000, 0 disables confidence intervals)\n"
+            "  -c level   confidence level for intervals (default 0.95)\n"
+            "  -s seed    random seed (default 1)\n"
+            "  -k column  frame time column name for CSV input\n",
+            argv0);
+}
+
+int main(int argc, char** argv)
+{
+    Options opt = { 2000, 0.95, 1, NULL };
+    Series* series;
+    int count = 0, argi;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0'; ++argi)
+    {
+        const char* arg = argv[argi];
+        if (argi + 1 >= argc || arg[2] != '\0')
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+        switch (arg[1])
+        {
+            case 'b':
+                opt.bootstrap = (unsigned)strtoul(argv[++argi], NULL, 10);
+                break;
+            case 'c':
+                opt.confidence = strtod(argv[++argi], NULL);
+                break;
+            case 's':
+                opt.seed = strtoull(argv[++argi], NULL, 10);
+                break;
+            case 'k':
+                opt.column = argv[++argi];
+                break;
+            default:
+                Usage(argv[0]);
+                return 2;
+        }
+    }
+    if (argc - argi < 1 || !(opt.confidence > 0.0 && opt.confidence < 1.0))
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    series = (Series*)calloc((size_t)(argc - argi), sizeof(Series));
+    if (!series)
+        return 1;
+
+    for (; argi < argc; ++argi, ++count)
+    {
+        char* path = argv[argi];
+        char* eq = strchr(path, '=');
+        Series* s = &series[count];
+
+        s->label = path;
+        if (eq)
+        {
+            *eq = '\0';
+            path = eq + 1;
+        }
+        if (!LoadSeries(s, path, &opt))
+            return 1;
+        Summarize(s, &opt);
+    }
+
+    printf("%-24s %8s %9s", "configuration", "frames", "mean");
+    for (size_t p = 0; p < NUM_PERCENTILES; ++p)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "p%g%s", kPercentiles[p], opt.bootstrap ? " [ci]" : "");
+        printf("  %-27s", name);
+    }
+    printf("\n");
+    for (int c = 0; c < count; ++c)
+    {
+        const Series* s = &series[c];
+        printf("%-24s %8zu %9.3f", s->label, s->count, s->mean);
+        for (size_t p = 0; p < NUM_PERCENTILES; ++p)
+        {
+            if (opt.bootstrap)
+                printf("  %7.3f [%6.3f, %6.3f]   ", s->pct[p], s->lo[p], s->hi[p]);
+            else
+                printf("  %7.3f %19s", s->pct[p], "");
+        }
+        printf("\n");
+    }
+
+    if (count > 1)
+    {
+        printf("\n%-24s %-24s %11s %9s %10s %10s\n", "A", "B", "p-value", "effect", "d p50", "d p99");
+        for (int x = 0; x < count; ++x)
+        {
+            for (int y = x + 1; y < count; ++y)
+            {
+                double effect, pvalue = MannWhitney(&series[x], &series[y], &effect);
+                printf("%-24s %-24s %11.3g %+9.3f %+10.3f %+10.3f%s\n", series[x].label, series[y].label, pvalue,
+                       effect, series[y].pct[0] - series[x].pct[0], series[y].pct[2] - series[x].pct[2],
+                       pvalue < 1.0 - opt.confidence ? "  *" : "");
+            }
+        }
+        printf("\neffect: rank-biserial correlation, positive when B has longer frame times than A. "
+               "* = significant at %g.\n",
+               1.0 - opt.confidence);
+    }
+    return 0;
+}
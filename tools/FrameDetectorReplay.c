@@ -0,0 +1,78 @@
+/**
+ * @file FrameDetectorReplay.c
+ * @brief Replays a recorded wait trace through the FrameDetector and prints the frames it finds
+ *
+ * The trace is text with one wait per line: `begin_us,end_us` (microsecond timestamps of a single thread's wait).
+ * Lines starting with '#' are ignored, except `# expect frames=N`: then the run fails (exit status 1) unless the
+ * detector finds N frames, give or take 1%. This is how detector changes are checked against captures from real games
+ * and the traces in tools/traces, which reproduce patterns that have fooled the detector before.
+ *
+ * Build with e.g. `cc -O2 -I. -o FrameDetectorReplay tools/FrameDetectorReplay.c FrameDetector.c -lm`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "FrameDetector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char** argv)
+{
+    char line[256];
+    FrameDetector fd;
+    FrameStats stats;
+    FILE* f;
+    int verbose = 0;
+    unsigned long long waits = 0, expected = 0, tolerance;
+
+    if (argc > 1 && !strcmp(argv[1], "-v"))
+    {
+        verbose = 1;
+        --argc, ++argv;
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: FrameDetectorReplay [-v] trace.csv\n");
+        return 2;
+    }
+    if (!(f = fopen(argv[1], "r")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    FrameDetector_Init(&fd, 1000000);
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long long begin, end;
+
+        if (line[0] == '#')
+        {
+            sscanf(line, "# expect frames=%llu", &expected);
+            continue;
+        }
+        if (sscanf(line, "%llu,%llu", &begin, &end) != 2 || end < begin)
+            continue;
+
+        ++waits;
+        FrameDetector_WaitBegin(&fd, begin);
+        if (FrameDetector_WaitEnd(&fd, end) && verbose)
+            printf("frame %llu at %llu us: %.3f ms\n", (unsigned long long)fd.frames, end, fd.lastFrame / 1000.0);
+    }
+    fclose(f);
+
+    FrameDetector_GetStats(&fd, &stats);
+    printf("waits=%llu frames=%llu avg=%.3f ms jitter=%.3f ms locked=%s\n", waits, (unsigned long long)stats.frames,
+           stats.avgMs, stats.jitterMs, stats.locked ? "yes" : "no");
+
+    tolerance = expected / 100;
+    if (expected && (stats.frames + tolerance < expected || stats.frames > expected + tolerance))
+    {
+        printf("FAILED: expected %llu frames\n", expected);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file IocpBench.c
+ * @brief Measures how I/O completion workers interfere with busy threads for a given port concurrency
+ *
+ * Creates a completion port with the given concurrency (0 is the Windows default: one per processor), starts a pool of
+ * worker threads on it and posts packets that each take a little CPU work, the way an asset or network service does.
+ * Meanwhile a few "game" threads spin and count iterations. It prints packets per second, the peak number of workers
+ * that were running at once and the game threads' iterations per second. Under CpuLimiter, a concurrency of 0 is
+ * clamped to the limited processor count; compare it with an explicit concurrency equal to the machine's processor
+ * count to see how much of the game threads' CPU time the unclamped default costs.
+ *
+ * Unlike the portable tools this one needs Windows. Build with e.g. `cl /O2 tools\IocpBench.c`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 256
+
+typedef struct Bench
+{
+    HANDLE port;
+    unsigned work; // Iterations of busy work per packet
+    volatile LONG running;
+    volatile LONG peak;
+    volatile LONG stop;
+} Bench;
+
+typedef struct GameThread
+{
+    Bench* bench;
+    volatile unsigned long long iterations;
+} GameThread;
+
+static unsigned long long Burn(unsigned iterations)
+{
+    volatile unsigned long long x = 0;
+    for (unsigned i = 0; i < iterations; ++i)
+        x += i * 2654435761u;
+    return x;
+}
+
+static DWORD WINAPI Worker(LPVOID param)
+{
+    Bench* b = (Bench*)param;
+    DWORD bytes;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped;
+
+    while (GetQueuedCompletionStatus(b->port, &bytes, &key, &overlapped, INFINITE) && key)
+    {
+        LONG running = InterlockedIncrement(&b->running), peak;
+        while (running > (peak = b->peak) && InterlockedCompareExchange(&b->peak, running, peak) != peak)
+            ;
+        Burn(b->work);
+        InterlockedDecrement(&b->running);
+    }
+    return 0;
+}
+
+static DWORD WINAPI Game(LPVOID param)
+{
+    GameThread* g = (GameThread*)param;
+    while (!g->bench->stop)
+    {
+        Burn(1000);
+        ++g->iterations;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static HANDLE threads[MAX_THREADS];
+    static GameThread games[MAX_THREADS];
+    Bench b = { 0 };
+    SYSTEM_INFO si;
+    LARGE_INTEGER freq, start, end;
+    unsigned workers, packets, concurrency, gameThreads;
+    unsigned long long gameIterations = 0;
+    double seconds;
+
+    GetSystemInfo(&si);
+    workers = argc > 1 ? atoi(argv[1]) : 2 * si.dwNumberOfProcessors;
+    packets = argc > 2 ? atoi(argv[2]) : 200000;
+    b.work = argc > 3 ? atoi(argv[3]) : 20000;
+    concurrency = argc > 4 ? atoi(argv[4]) : 0;
+    gameThreads = argc > 5 ? atoi(argv[5]) : 2;
+    if (!workers || workers > MAX_THREADS || gameThreads > MAX_THREADS || argc > 6)
+    {
+        fprintf(stderr, "Usage: IocpBench [workers] [packets] [work per packet] [port concurrency] [game threads]\n");
+        return 2;
+    }
+
+    if (!(b.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, concurrency)))
+    {
+        fprintf(stderr, "CreateIoCompletionPort failed: %lu\n", GetLastError());
+        return 1;
+    }
+    printf("%u processors, %u workers, concurrency %u, %u game threads\n", si.dwNumberOfProcessors, workers,
+           concurrency, gameThreads);
+
+    for (unsigned i = 0; i < workers; ++i)
+        threads[i] = CreateThread(NULL, 0, Worker, &b, 0, NULL);
+    for (unsigned i = 0; i < gameThreads; ++i)
+    {
+        games[i].bench = &b;
+        CloseHandle(CreateThread(NULL, 0, Game, &games[i], 0, NULL));
+    }
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (unsigned i = 0; i < packets; ++i)
+        PostQueuedCompletionStatus(b.port, 0, 1, NULL);
+    // A zero key tells a worker to exit; the port hands them out only after every packet before them
+    for (unsigned i = 0; i < workers; ++i)
+        PostQueuedCompletionStatus(b.port, 0, 0, NULL);
+    for (unsigned i = 0; i < workers; i += MAXIMUM_WAIT_OBJECTS)
+        WaitForMultipleObjects(min(workers - i, MAXIMUM_WAIT_OBJECTS), threads + i, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+    b.stop = 1;
+
+    seconds = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    for (unsigned i = 0; i < gameThreads; ++i)
+        gameIterations += games[i].iterations;
+    printf("%.0f packets/s, peak %ld workers running, %.0f game iterations/s per game thread\n", packets / seconds,
+           b.peak, gameThreads ? gameIterations / seconds / gameThreads : 0.0);
+
+    for (unsigned i = 0; i < workers; ++i)
+        CloseHandle(threads[i]);
+    CloseHandle(b.port);
+    return 0;
+}
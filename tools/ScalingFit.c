@@ -0,0 +1,302 @@
+/**
+ * @file ScalingFit.c
+ * @brief Fits Amdahl's law and the Universal Scalability Law to throughput measured at several CPU counts
+ *
+ * Input is one measurement per line, `cpus,throughput` (whitespace works too); repeated CPU counts are fine and lines
+ * starting with '#' are ignored. Collect it by running the same workload under CpuLimiter builds with NUM_CPUS = 1, 2,
+ * ... up to the machine's count, keeping the rest of the configuration (and so the CPU selection policy) fixed.
+ *
+ * Both models are fitted by least squares on throughput:
+ *
+ *     Amdahl  X(N) = lambda * N / (1 + sigma * (N - 1))
+ *     USL     X(N) = lambda * N / (1 + sigma * (N - 1) + kappa * N * (N - 1))
+ *
+ * sigma is contention (the serial fraction), kappa is coherency (crosstalk, which makes throughput fall past a peak).
+ * The output gives the coefficients and fit quality, the USL's peak N, the point of diminishing returns (the first N
+ * where one more CPU adds less than a given share of one CPU's throughput) and a table of measured and predicted
+ * throughput.
+ *
+ * Build with e.g. `cc -O2 -o ScalingFit tools/ScalingFit.c -lm`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_POINTS 4096
+// Amdahl sigma below this is taken as 0: no measurable serial fraction
+#define SIGMA_EPSILON 1e-6
+
+typedef struct Point
+{
+    double n;
+    double x;
+} Point;
+
+typedef struct Model
+{
+    double lambda, sigma, kappa;
+    double sse; // Sum of squared residuals
+} Model;
+
+static Point Points[MAX_POINTS];
+static unsigned PointCount;
+
+static double Predict(const Model* m, double n)
+{
+    return m->lambda * n / (1.0 + m->sigma * (n - 1.0) + m->kappa * n * (n - 1.0));
+}
+
+// For fixed sigma and kappa the best lambda has a closed form; fills it and the residual in
+static void FitLambda(Model* m)
+{
+    double gy = 0.0, gg = 0.0;
+
+    for (unsigned i = 0; i < PointCount; ++i)
+    {
+        double g = Predict(&(Model){ 1.0, m->sigma, m->kappa, 0.0 }, Points[i].n);
+        gy += g * Points[i].x;
+        gg += g * g;
+    }
+    m->lambda = gg > 0.0 ? gy / gg : 0.0;
+    m->sse = 0.0;
+    for (unsigned i = 0; i < PointCount; ++i)
+    {
+        double r = Points[i].x - Predict(m, Points[i].n);
+        m->sse += r * r;
+    }
+}
+
+static double Cost(double sigma, double kappa, Model* m)
+{
+    m->sigma = sigma;
+    m->kappa = kappa;
+    FitLambda(m);
+    return m->sse;
+}
+
+// Amdahl: golden-section search for sigma in [0, 1]
+static Model FitAmdahl()
+{
+    const double phi = 0.6180339887498949;
+    double a = 0.0, b = 1.0;
+    Model m;
+
+    for (int i = 0; i < 200 && b - a > 1e-12; ++i)
+    {
+        double c = b - phi * (b - a), d = a + phi * (b - a);
+        if (Cost(c, 0.0, &m) < Cost(d, 0.0, &m))
+            b = d;
+        else
+            a = c;
+    }
+    // Perfectly linear data leaves the search a rounding error above 0, which would promise an absurd speedup
+    Cost((a + b) / 2.0 >= SIGMA_EPSILON ? (a + b) / 2.0 : 0.0, 0.0, &m);
+    return m;
+}
+
+// USL: Nelder-Mead over (sigma, kappa), both kept non-negative, started from Amdahl's sigma
+static Model FitUsl(const Model* amdahl)
+{
+    double v[3][2] = { { amdahl->sigma, 0.0 }, { amdahl->sigma + 0.05, 0.0 }, { amdahl->sigma, 0.001 } };
+    double f[3];
+    Model m;
+
+    for (int i = 0; i < 3; ++i)
+        f[i] = Cost(v[i][0], v[i][1], &m);
+
+    for (int iter = 0; iter < 2000; ++iter)
+    {
+        int best = 0, worst = 0, mid;
+        double c[2], r[2], fr;
+
+        for (int i = 1; i < 3; ++i)
+        {
+            if (f[i] < f[best])
+                best = i;
+            if (f[i] > f[worst])
+                worst = i;
+        }
+        mid = 3 - best - worst;
+        if (best == worst || fabs(f[worst] - f[best]) <= 1e-15 * (fabs(f[best]) + 1e-300))
+            break;
+
+        for (int k = 0; k < 2; ++k)
+        {
+            c[k] = (v[best][k] + v[mid][k]) / 2.0;
+            r[k] = fmax(c[k] + (c[k] - v[worst][k]), 0.0);
+        }
+        fr = Cost(r[0], r[1], &m);
+
+        if (fr < f[best])
+        {
+            double e[2], fe;
+            for (int k = 0; k < 2; ++k)
+                e[k] = fmax(c[k] + 2.0 * (c[k] - v[worst][k]), 0.0);
+            if ((fe = Cost(e[0], e[1], &m)) < fr)
+                memcpy(v[worst], e, sizeof(e)), f[worst] = fe;
+            else
+                memcpy(v[worst], r, sizeof(r)), f[worst] = fr;
+        }
+        else if (fr < f[mid])
+            memcpy(v[worst], r, sizeof(r)), f[worst] = fr;
+        else
+        {
+            double s[2], fs;
+            for (int k = 0; k < 2; ++k)
+                s[k] = c[k] + 0.5 * (v[worst][k] - c[k]);
+            if ((fs = Cost(s[0], s[1], &m)) < f[worst])
+                memcpy(v[worst], s, sizeof(s)), f[worst] = fs;
+            else
+            {
+                // Shrink toward the best vertex
+                for (int i = 0; i < 3; ++i)
+                {
+                    if (i == best)
+                        continue;
+                    for (int k = 0; k < 2; ++k)
+                        v[i][k] = v[best][k] + 0.5 * (v[i][k] - v[best][k]);
+                    f[i] = Cost(v[i][0], v[i][1], &m);
+                }
+            }
+        }
+    }
+
+    {
+        int best = 0;
+        for (int i = 1; i < 3; ++i)
+        {
+            if (f[i] < f[best])
+                best = i;
+        }
+        Cost(v[best][0], v[best][1], &m);
+    }
+    return m;
+}
+
+static double RSquared(const Model* m)
+{
+    double mean = 0.0, sst = 0.0;
+
+    for (unsigned i = 0; i < PointCount; ++i)
+        mean += Points[i].x / PointCount;
+    for (unsigned i = 0; i < PointCount; ++i)
+        sst += (Points[i].x - mean) * (Points[i].x - mean);
+    return sst > 0.0 ? 1.0 - m->sse / sst : 1.0;
+}
+
+// First N whose next CPU adds less than `share` of one CPU's throughput (lambda), or 0 if none up to `limit`
+static unsigned DiminishingReturns(const Model* m, double share, unsigned limit)
+{
+    for (unsigned n = 1; n < limit; ++n)
+    {
+        if (Predict(m, n + 1.0) - Predict(m, n) < share * m->lambda)
+            return n;
+    }
+    return 0;
+}
+
+// Average of the measurements at `n`, or NAN if there are none
+static double Measured(unsigned n)
+{
+    double sum = 0.0;
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < PointCount; ++i)
+    {
+        if (Points[i].n == n)
+            sum += Points[i].x, ++count;
+    }
+    return count ? sum / count : NAN;
+}
+
+int main(int argc, char** argv)
+{
+    char line[256];
+    FILE* f = stdin;
+    double share = 0.25, maxN = 0.0, peak = 0.0;
+    unsigned limit, amdahlKnee, uslKnee;
+    Model amdahl, usl;
+
+    for (; argc > 1 && argv[1][0] == '-' && argv[1][1]; --argc, ++argv)
+    {
+        if (!strcmp(argv[1], "-m") && argc > 2 && (share = atof(argv[2])) > 0.0)
+            --argc, ++argv;
+        else
+        {
+            fprintf(stderr, "Usage: ScalingFit [-m marginal_share] [measurements.csv]\n");
+            return 2;
+        }
+    }
+    if (argc > 1 && strcmp(argv[1], "-") && !(f = fopen(argv[1], "r")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f) && PointCount < MAX_POINTS)
+    {
+        Point* p = &Points[PointCount];
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%lf,%lf", &p->n, &p->x) != 2 && sscanf(line, "%lf %lf", &p->n, &p->x) != 2)
+            continue;
+        if (p->n < 1.0 || p->x < 0.0)
+            continue;
+        maxN = fmax(maxN, p->n);
+        ++PointCount;
+    }
+    if (f != stdin)
+        fclose(f);
+
+    if (PointCount < 3)
+    {
+        fprintf(stderr, "Need at least 3 measurements\n");
+        return 1;
+    }
+
+    amdahl = FitAmdahl();
+    usl = FitUsl(&amdahl);
+
+    printf("points=%u max_cpus=%.0f\n", PointCount, maxN);
+    if (amdahl.sigma > 0.0)
+        printf("amdahl: lambda=%.6g sigma=%.6f max_speedup=%.2f r2=%.4f\n", amdahl.lambda, amdahl.sigma,
+               1.0 / amdahl.sigma, RSquared(&amdahl));
+    else
+        printf("amdahl: lambda=%.6g sigma=%.6f max_speedup=>%.0f r2=%.4f\n", amdahl.lambda, amdahl.sigma, maxN,
+               RSquared(&amdahl));
+    printf("usl:    lambda=%.6g sigma=%.6f kappa=%.6g r2=%.4f\n", usl.lambda, usl.sigma, usl.kappa, RSquared(&usl));
+
+    // A kappa that is zero in all but rounding puts the peak absurdly far out
+    if (usl.kappa > 0.0 && usl.sigma < 1.0 && (peak = sqrt((1.0 - usl.sigma) / usl.kappa)) < 100.0 * maxN)
+        printf("usl peak: N=%.1f throughput=%.6g\n", peak, Predict(&usl, floor(peak + 0.5)));
+    else
+    {
+        peak = 0.0;
+        printf("usl peak: none (throughput keeps rising)\n");
+    }
+
+    // Look a little past what was measured, and past the peak if it is close
+    limit = (unsigned)fmin(fmax(maxN * 2.0, peak + 1.0), 4.0 * maxN);
+    amdahlKnee = DiminishingReturns(&amdahl, share, limit);
+    uslKnee = DiminishingReturns(&usl, share, limit);
+    printf("diminishing returns (next CPU adds < %.0f%% of one CPU): amdahl N=%u usl N=%u%s\n", share * 100.0,
+           amdahlKnee, uslKnee, amdahlKnee && uslKnee ? "" : " (0 = not within range)");
+
+    printf("\n%6s %12s %12s %12s\n", "cpus", "measured", "amdahl", "usl");
+    for (unsigned n = 1; n <= limit; ++n)
+    {
+        double x = Measured(n);
+        if (n > maxN && n % 4 && n != limit)
+            continue;
+        if (isnan(x))
+            printf("%6u %12s %12.6g %12.6g\n", n, "-", Predict(&amdahl, n), Predict(&usl, n));
+        else
+            printf("%6u %12.6g %12.6g %12.6g\n", n, x, Predict(&amdahl, n), Predict(&usl, n));
+    }
+    return 0;
+}
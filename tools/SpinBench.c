@@ -0,0 +1,134 @@
+/**
+ * @file SpinBench.c
+ * @brief Measures critical section throughput and CPU cost under contention for a given spin count
+ *
+ * Starts a number of threads that take the same critical section over and over, doing a little work inside it and
+ * some more outside, the way a job system's shared queue or an allocator's arena lock is used. The critical section is
+ * set up with InitializeCriticalSectionAndSpinCount and the spin count given. It prints acquisitions per second and the
+ * process CPU time spent per thousand acquisitions; spinning that doesn't pay off shows up as more CPU for the same or
+ * lower throughput. Under CpuLimiter with TUNE_SPIN_COUNTS, the spin count is scaled to the limited topology (the
+ * header line still shows the count that was asked for); compare a build with TUNE_SPIN_COUNTS against one without it
+ * at the same NUM_CPUS.
+ *
+ * Unlike the portable tools this one needs Windows. Build with e.g. `cl /O2 tools\SpinBench.c`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 256
+
+typedef struct Bench
+{
+    CRITICAL_SECTION lock;
+    unsigned inside; // Iterations of busy work while holding the lock
+    unsigned outside; // Iterations of busy work between acquisitions
+    volatile unsigned long long shared;
+    volatile LONG stop;
+} Bench;
+
+typedef struct Worker
+{
+    Bench* bench;
+    volatile unsigned long long acquisitions;
+} Worker;
+
+static unsigned long long Burn(unsigned iterations)
+{
+    volatile unsigned long long x = 0;
+    for (unsigned i = 0; i < iterations; ++i)
+        x += i * 2654435761u;
+    return x;
+}
+
+static DWORD WINAPI WorkerProc(LPVOID param)
+{
+    Worker* w = (Worker*)param;
+    Bench* b = w->bench;
+
+    while (!b->stop)
+    {
+        EnterCriticalSection(&b->lock);
+        b->shared += Burn(b->inside);
+        LeaveCriticalSection(&b->lock);
+        ++w->acquisitions;
+        Burn(b->outside);
+    }
+    return 0;
+}
+
+static ULONGLONG ProcessCpuTime()
+{
+    FILETIME creation, exit, kernel, user;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    return ((ULONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+           ((ULONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime);
+}
+
+int main(int argc, char** argv)
+{
+    static HANDLE threads[MAX_THREADS];
+    static Worker workers[MAX_THREADS];
+    Bench b = { 0 };
+    SYSTEM_INFO si;
+    unsigned count, spin, milliseconds;
+    unsigned long long acquisitions = 0;
+    ULONGLONG cpuStart, cpuEnd;
+    LARGE_INTEGER freq, start, end;
+    double seconds;
+
+    GetSystemInfo(&si);
+    count = argc > 1 ? atoi(argv[1]) : si.dwNumberOfProcessors;
+    spin = argc > 2 ? strtoul(argv[2], NULL, 0) : 4000;
+    b.inside = argc > 3 ? atoi(argv[3]) : 200;
+    b.outside = argc > 4 ? atoi(argv[4]) : 2000;
+    milliseconds = argc > 5 ? atoi(argv[5]) : 3000;
+    if (!count || count > MAX_THREADS || argc > 6)
+    {
+        fprintf(stderr, "Usage: SpinBench [threads] [spin count] [work inside] [work outside] [milliseconds]\n");
+        return 2;
+    }
+
+    if (!InitializeCriticalSectionAndSpinCount(&b.lock, spin))
+    {
+        fprintf(stderr, "InitializeCriticalSectionAndSpinCount failed: %lu\n", GetLastError());
+        return 1;
+    }
+    printf("%u processors, %u threads, spin count %u, work %u inside / %u outside\n", si.dwNumberOfProcessors, count,
+           spin, b.inside, b.outside);
+
+    QueryPerformanceFrequency(&freq);
+    cpuStart = ProcessCpuTime();
+    QueryPerformanceCounter(&start);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        workers[i].bench = &b;
+        threads[i] = CreateThread(NULL, 0, WorkerProc, &workers[i], 0, NULL);
+    }
+    Sleep(milliseconds);
+    b.stop = 1;
+    for (unsigned i = 0; i < count; i += MAXIMUM_WAIT_OBJECTS)
+        WaitForMultipleObjects(min(count - i, MAXIMUM_WAIT_OBJECTS), threads + i, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+    cpuEnd = ProcessCpuTime();
+
+    seconds = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        acquisitions += workers[i].acquisitions;
+        CloseHandle(threads[i]);
+    }
+    printf("%.0f acquisitions/s, %.3f ms CPU per 1000 acquisitions\n", acquisitions / seconds,
+           acquisitions ? (double)(cpuEnd - cpuStart) / 1e4 / acquisitions * 1000.0 : 0.0);
+
+    DeleteCriticalSection(&b.lock);
+    return 0;
+}
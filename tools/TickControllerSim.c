@@ -0,0 +1,121 @@
+/**
+ * @file TickControllerSim.c
+ * @brief Runs the TickController against a simulated server and prints how it sizes the core set
+ *
+ * Each tick's work is given as `serial_ms,parallel_ms`: the tick takes serial_ms plus parallel_ms spread over however
+ * many cores the controller currently allows. Lines starting with '#' are ignored. Without a trace file a synthetic one
+ * is generated: a light load, a heavy spike, then light again, with some noise.
+ *
+ * The simulated server runs one tick per period (the target unless given) and sleeps out the rest of it. Like the DLL,
+ * the controller is fed each tick's busy time, the interval between tick boundaries minus the wait at the boundary.
+ *
+ * Build with e.g. `cc -O2 -I. -o TickControllerSim tools/TickControllerSim.c TickController.c -lm`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "TickController.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ticks between control updates (the DLL updates about once a second)
+#define TICKS_PER_UPDATE 64
+
+static unsigned long long rngState = 88172645463325252ull;
+
+// Uniform in [0, 1)
+static double Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (double)(rngState >> 11) / 9007199254740992.0;
+}
+
+// Fills in the next tick of the synthetic trace. Returns 0 when done.
+static int Synthetic(unsigned long long tick, double* serial, double* parallel)
+{
+    double load;
+
+    if (tick >= 6000)
+        return 0;
+    load = (tick >= 2000 && tick < 4000) ? 60.0 : 20.0;
+    *serial = 2.0 + Random();
+    *parallel = load * (0.9 + 0.2 * Random());
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    char line[256];
+    TickController tc;
+    FILE* f = NULL;
+    double target = 16.0, period = 0.0;
+    unsigned minCores = 1, maxCores = 16;
+    unsigned long long tick = 0, overTarget = 0, coreTicks = 0;
+
+    for (; argc > 1 && argv[1][0] == '-' && argv[1][1]; --argc, ++argv)
+    {
+        if (!strcmp(argv[1], "-t") && argc > 2)
+            target = atof(argv[2]);
+        else if (!strcmp(argv[1], "-p") && argc > 2)
+            period = atof(argv[2]);
+        else if (!strcmp(argv[1], "-n") && argc > 2 && sscanf(argv[2], "%u,%u", &minCores, &maxCores) == 2)
+            ;
+        else
+        {
+            fprintf(stderr, "Usage: TickControllerSim [-t target_ms] [-p period_ms] [-n min,max] [trace.csv]\n");
+            return 2;
+        }
+        --argc, ++argv;
+    }
+    if (argc > 1 && !(f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (period <= 0.0)
+        period = target;
+
+    TickController_Init(&tc, target, minCores, maxCores);
+    printf("%8s %6s %9s\n", "tick", "cores", "p99_ms");
+    for (;;)
+    {
+        double serial, parallel, ms, interval, wait;
+
+        if (f)
+        {
+            if (!fgets(line, sizeof(line), f))
+                break;
+            if (line[0] == '#' || sscanf(line, "%lf,%lf", &serial, &parallel) != 2)
+                continue;
+        }
+        else if (!Synthetic(tick, &serial, &parallel))
+            break;
+
+        // An overrunning tick starts the next one straight away, without a wait
+        ms = serial + parallel / tc.cores;
+        interval = ms > period ? ms : period;
+        wait = interval - ms;
+        TickController_AddTick(&tc, interval - wait);
+        overTarget += ms > target;
+        coreTicks += tc.cores;
+
+        if (++tick % TICKS_PER_UPDATE == 0)
+        {
+            TickController_Update(&tc);
+            printf("%8llu %6u %9.3f\n", tick, tc.cores, tc.lastP99);
+        }
+    }
+    if (f && f != stdin)
+        fclose(f);
+
+    if (tick)
+        printf("ticks=%llu over_target=%.2f%% avg_cores=%.2f\n", tick, 100.0 * overTarget / tick,
+               (double)coreTicks / tick);
+    return 0;
+}
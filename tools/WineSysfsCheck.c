@@ -0,0 +1,188 @@
+/**
+ * @file WineSysfsCheck.c
+ * @brief Runs the Wine topology parser (WineSysfs.c) against a captured sysfs tree and checks what it finds
+ *
+ * A capture is the output of
+ *
+ *     cd /sys/devices && grep -r . system/cpu system/node cpu_atom 2>/dev/null
+ *
+ * on the host: one `path:contents` line per file. Lines starting with '#' are ignored, except `# expect ...`: the
+ * online CPUs and every cache found are printed as `online=LIST` and `cache cpu=N L<level> <type> size=<bytes>
+ * ways=<ways> line=<bytes> cpus=LIST` lines, and the run fails (exit status 1) unless they match the expect lines in
+ * order. The CPU list parser is checked against a few fixed cases first. The captures in tools/sysfs cover the layouts
+ * the parser has to get right.
+ *
+ * Build with e.g. `cc -O2 -I. -o WineSysfsCheck tools/WineSysfsCheck.c WineSysfs.c`.
+ *
+ * @copyright Copyright (c) 2024 Joshua Kriegshauser
+ *
+ */
+
+#include "WineSysfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINES 65536
+#define MAX_CPUS 64
+
+typedef struct Capture
+{
+    char* lines[MAX_LINES]; // "path:contents", NUL-terminated without the newline
+    unsigned count;
+    char* expect[MAX_LINES];
+    unsigned expectCount;
+} Capture;
+
+static Capture Tree;
+
+static int ReadCaptured(void* context, const char* path, char* buf, size_t size)
+{
+    const Capture* c = (const Capture*)context;
+    size_t length = strlen(path);
+
+    // Files with several lines show up once per line; the parser only needs the first
+    for (unsigned i = 0; i < c->count; ++i)
+    {
+        if (!strncmp(c->lines[i], path, length) && c->lines[i][length] == ':' && c->lines[i][length + 1])
+        {
+            snprintf(buf, size, "%s\n", c->lines[i] + length + 1);
+            return 1;
+        }
+    }
+    buf[0] = '\0';
+    return 0;
+}
+
+// The inverse of SysfsParseCpuList
+static const char* FormatCpuList(uint64_t mask, char* buf, size_t size)
+{
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (unsigned cpu = 0; cpu < MAX_CPUS && used < size; ++cpu)
+    {
+        unsigned last = cpu;
+        if (!(mask & (uint64_t)1 << cpu))
+            continue;
+        while (last + 1 < MAX_CPUS && mask & (uint64_t)1 << (last + 1))
+            ++last;
+        used += snprintf(buf + used, size - used, last > cpu ? "%s%u-%u" : "%s%u", used ? "," : "", cpu, last);
+        cpu = last;
+    }
+    return buf;
+}
+
+static int CheckCpuLists()
+{
+    static const struct
+    {
+        const char* list;
+        unsigned maxCpus;
+        uint64_t mask;
+    } cases[] = {
+        { "0\n", 64, 0x1 },
+        { "0-3,8-11\n", 64, 0xf0f },
+        { "1,3,5-6", 64, 0x6a },
+        { "0-63\n", 64, ~(uint64_t)0 },
+        { "0-63\n", 32, 0xffffffff },
+        { "30-33\n", 32, 0xc0000000 },
+        { "64-65\n", 64, 0 },
+        { "\n", 64, 0 },
+        { "", 64, 0 },
+    };
+    int failed = 0;
+
+    for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        uint64_t mask = SysfsParseCpuList(cases[i].list, cases[i].maxCpus);
+        if (mask != cases[i].mask)
+        {
+            printf("FAILED: SysfsParseCpuList(\"%.*s\", %u) = %#llx, expected %#llx\n",
+                   (int)strcspn(cases[i].list, "\n"), cases[i].list, cases[i].maxCpus, (unsigned long long)mask,
+                   (unsigned long long)cases[i].mask);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static unsigned Printed;
+static int Failed;
+
+// Prints a line of what was found and checks it against the next expect line, if there are any
+static void Report(const char* out)
+{
+    printf("%s\n", out);
+    if (Tree.expectCount && (Printed >= Tree.expectCount || strcmp(out, Tree.expect[Printed])))
+    {
+        printf("FAILED: expected %s\n", Printed < Tree.expectCount ? Tree.expect[Printed] : "nothing more");
+        Failed = 1;
+    }
+    ++Printed;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* types[] = { "Unified", "Instruction", "Data" };
+    static char line[4096];
+    SysfsReader reader = { ReadCaptured, &Tree };
+    SysfsCache caches[SYSFS_MAX_CACHES];
+    char text[256], list[256], out[512];
+    uint64_t online;
+    FILE* f;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: WineSysfsCheck capture.txt\n");
+        return 2;
+    }
+    if (!(f = fopen(argv[1], "r")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f) && Tree.count < MAX_LINES)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!strncmp(line, "# expect ", 9) && Tree.expectCount < MAX_LINES)
+            Tree.expect[Tree.expectCount++] = strdup(line + 9);
+        else if (line[0] && line[0] != '#')
+            Tree.lines[Tree.count++] = strdup(line);
+    }
+    fclose(f);
+
+    Failed = CheckCpuLists();
+
+    if (!ReadCaptured(&Tree, "system/cpu/online", text, sizeof(text)) || !(online = SysfsParseCpuList(text, MAX_CPUS)))
+    {
+        printf("FAILED: no online CPUs in %s\n", argv[1]);
+        return 1;
+    }
+    snprintf(out, sizeof(out), "online=%s", FormatCpuList(online, list, sizeof(list)));
+    Report(out);
+
+    // In the order the DLL adds them
+    for (unsigned cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        unsigned count;
+        if (!(online & (uint64_t)1 << cpu))
+            continue;
+        count = SysfsReadCaches(&reader, cpu, online, MAX_CPUS, caches);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            snprintf(out, sizeof(out), "cache cpu=%u L%u %s size=%u ways=%u line=%u cpus=%s", cpu, caches[i].level,
+                     types[caches[i].type], caches[i].size, caches[i].associativity, caches[i].lineSize,
+                     FormatCpuList(caches[i].mask, list, sizeof(list)));
+            Report(out);
+        }
+    }
+
+    if (Printed < Tree.expectCount)
+    {
+        printf("FAILED: expected %s\n", Tree.expect[Printed]);
+        Failed = 1;
+    }
+    return Failed;
+}